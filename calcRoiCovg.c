@@ -17,11 +17,56 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <getopt.h>
 
 #include "calcRoiCovg.h"
+#include "roiShard.h"
+#include "roiCheckpoint.h"
+#include "readGroups.h"
 
 pileup_data_t data;
 
+// --shard i/N, 0/0 when not sharded
+int shard_idx = 0;
+int shard_cnt = 0;
+
+// --bgzip, write bgzipped and tabix 
+// indexed output
+//
+bool bgzip = false;
+
+// --checkpoint and --resume
+roi_checkpoint_t ckpt;
+bool resume = false;
+
+// ROIs between checkpoints when 
+// --resume is given without -k
+//
+#define DEFAULT_CHECKPOINT_EVERY 1000
+
+// --mem-budget, MB for the refseq 
+// window and its per-base tags
+//
+uint64_t mem_budget = 256;
+
+// Loci past this can't be fetched from a BAM: 
+// bam_fetch() bins clamp the region to 2^29
+//
+#define MAX_BAM_LOCUS (1 << 29)
+
+// --group-by RG|LB and --group-map, 
+// for per read group counts
+//
+char *group_by = NULL;
+char *group_map = NULL;
+
+// --depth-stats, depth cutoffs to 
+// report the fraction of bases at
+//
+char *depth_cutoffs_arg = NULL;
+uint32_t depth_cutoffs[MAX_DEPTH_CUTOFFS];
+int n_depth_cutoffs = 0;
+
 // usage infor
 void usage(void)
 {
@@ -29,12 +74,31 @@ void usage(void)
     // usage
     fprintf(stderr, "\n");
     fprintf(stderr, "Version 0.1\n");
-    fprintf(stderr, "Usage: calcRoiCovg <bam1> <bam2> <roi_file> <ref_seq_fasta> <output_file>\n\n");
+    fprintf(stderr, "Usage: calcRoiCovg <bam1> <bam2> <roi_file> <ref_seq_fasta> <output_file>\n");
+    fprintf(stderr, "       calcRoiCovg merge <output_file> <shard_output>...\n\n");
 
     fprintf(stderr, "        -q INT    filtering reads with mapping quality less than INT [%d]\n", data.min_mapq);
     fprintf(stderr, "        -n INT    minimum reads depth for bam1 [%d]\n", data.min_depth_bam1);
     fprintf(stderr, "        -t INT    minimum reads depth for bam2 [%d]\n", data.min_depth_bam2);
     fprintf(stderr, "        -c STRING bp class types, delimited by comma, default: \"AT,CG,CpG\"\n");
+    fprintf(stderr, "        -s, --shard i/N  only count the i-th of N shards balanced by ROI bases;\n");
+    fprintf(stderr, "                         overlapping ROIs stay in one shard. Combine the N\n");
+    fprintf(stderr, "                         outputs with 'calcRoiCovg merge'\n");
+    fprintf(stderr, "        -z, --bgzip      bgzip the output and write a tabix index next to it;\n");
+    fprintf(stderr, "                         the ROI column is split into Chrom, Start and End\n");
+    fprintf(stderr, "        -k, --checkpoint INT  journal progress to <output_file>.ckpt every INT ROIs\n");
+    fprintf(stderr, "        -r, --resume     continue from <output_file>.ckpt if it exists, with the\n");
+    fprintf(stderr, "                         same inputs and options; checkpoints every %d ROIs\n", DEFAULT_CHECKPOINT_EVERY);
+    fprintf(stderr, "                         unless -k is given\n");
+    fprintf(stderr, "        -m, --mem-budget INT  MB of refseq (and per-base tags) held at once [%lu];\n", (unsigned long)mem_budget);
+    fprintf(stderr, "                         long contigs and ROIs are streamed in windows\n");
+    fprintf(stderr, "        -g, --group-by RG|LB  also count each read group (RG) or library (LB) of\n");
+    fprintf(stderr, "                         the BAM headers on its own, in extra columns\n");
+    fprintf(stderr, "        -G, --group-map FILE  like -g, with groups from a tab-delimited list of\n");
+    fprintf(stderr, "                         [RG ID, group]; pairs bam1 and bam2 read groups\n");
+    fprintf(stderr, "        -d, --depth-stats LIST  also report mean, median, min and max depth of\n");
+    fprintf(stderr, "                         each ROI per BAM, and the fraction of bases at or\n");
+    fprintf(stderr, "                         above each depth of LIST, delimited by comma, e.g. 1,10,20\n");
     
     fprintf( stderr, "\n\nROI file should be a tab-delimited list of [chrom, start, stop, annotation]" );
     fprintf( stderr, "\nwhere start and stop are both 1-based chromosomal loci. For example:" );
@@ -50,7 +114,20 @@ int mGetOptions(int rgc, char *rgv[])
 {
     int c;
 
-    while ((c = getopt(rgc, rgv, "q:n:t:c:")) >= 0)
+    static struct option long_options[] =
+    {
+        {"shard", required_argument, 0, 's'},
+        {"bgzip", no_argument, 0, 'z'},
+        {"checkpoint", required_argument, 0, 'k'},
+        {"resume", no_argument, 0, 'r'},
+        {"mem-budget", required_argument, 0, 'm'},
+        {"group-by", required_argument, 0, 'g'},
+        {"group-map", required_argument, 0, 'G'},
+        {"depth-stats", required_argument, 0, 'd'},
+        {0, 0, 0, 0}
+    };
+
+    while ((c = getopt_long(rgc, rgv, "q:n:t:c:s:zk:rm:g:G:d:", long_options, NULL)) >= 0)
     {
         switch (c) {
 
@@ -58,6 +135,35 @@ int mGetOptions(int rgc, char *rgv[])
             case 'n': data.min_depth_bam1 = atoi(optarg); break;
             case 't': data.min_depth_bam2 = atoi(optarg); break;
             case 'c': data.bp_class_types = optarg; break;
+            case 's':
+                if (!parseShard(optarg, &shard_idx, &shard_cnt))
+                {
+                    fprintf(stderr, "Shard should be i/N with 1 <= i <= N, got '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'z': bgzip = true; break;
+            case 'k': ckpt.every = atoi(optarg); break;
+            case 'r': resume = true; break;
+            case 'm': mem_budget = strtoull(optarg, NULL, 10); break;
+            case 'g':
+                if (strcasecmp(optarg, "RG") && strcasecmp(optarg, "LB"))
+                {
+                    fprintf(stderr, "Group by should be RG or LB, got '%s'\n", optarg);
+                    exit(1);
+                }
+                group_by = optarg;
+                break;
+            case 'G': group_map = optarg; break;
+            case 'd':
+                if (!parseDepthCutoffs(optarg, depth_cutoffs, &n_depth_cutoffs))
+                {
+                    fprintf(stderr, "Depth cutoffs should be up to %d comma delimited depths <= %d, got '%s'\n", 
+                            MAX_DEPTH_CUTOFFS, DEPTH_HIST_MAX, optarg);
+                    exit(1);
+                }
+                depth_cutoffs_arg = optarg;
+                break;
 
             default: fprintf(stderr, "Unrecognized option '-%c'.\n", c); return 1;
         }
@@ -67,9 +173,166 @@ int mGetOptions(int rgc, char *rgv[])
     return(c);
 }
 
+// Tabix needs the rows grouped by contig and sorted by start. 
+// Check the ROI file for that before counting, then rewind it
+//
+bool roisSorted(FILE *roiFp)
+{
+    size_t length = 0;
+    char *line = NULL;
+    char name[50], prev[50] = "";
+    unsigned long long beg, end, prev_beg = 0;
+    bool sorted = true;
+    int ret;
+
+    khash_t(s) *done = kh_init(s);
+    khiter_t k;
+
+    while (sorted && getline(&line, &length, roiFp) != -1)
+    {
+        if (sscanf(line, "%49s %llu %llu", name, &beg, &end) != 3) continue;
+
+        if (strcmp(name, prev))
+        {
+            kh_put(s, done, strdup(prev), &ret);
+
+            k = kh_get(s, done, name);
+            sorted = (k == kh_end(done));
+
+            strcpy(prev, name);
+        }
+        else
+        {
+            sorted = (beg >= prev_beg);
+        }
+
+        prev_beg = beg;
+
+        if (!sorted) fprintf(stderr, "ROI out of order for --bgzip: %s", line);
+    }
+
+    for (k = kh_begin(done); k != kh_end(done); ++k)
+    {
+        if (kh_exist(done, k)) free((char*)kh_key(done, k));
+    }
+
+    kh_destroy(s, done);
+
+    if (line) free(line);
+    rewind(roiFp);
+
+    return sorted;
+}
+
+// Depth summary columns of one BAM 
+// over the len bases of an ROI
+//
+void putDepthStats(roi_writer_t *w, const depth_stats_t *st, uint64_t len)
+{
+    char buf[32];
+    int k;
+
+    snprintf(buf, sizeof(buf), "%.2f", len ? (double)st->sum / len : 0.0);
+
+    wPutc(w, '\t');
+    wPuts(w, buf);
+    wPutc(w, '\t');
+    wPutu(w, depthMedian(st, len));
+    wPutc(w, '\t');
+    wPutu(w, depthMin(st, len));
+    wPutc(w, '\t');
+    wPutu(w, st->max);
+
+    for (k = 0; k < n_depth_cutoffs; ++k)
+    {
+        snprintf(buf, sizeof(buf), "%.4f", len ? (double)depthAtLeast(st, len, depth_cutoffs[k]) / len : 0.0);
+
+        wPutc(w, '\t');
+        wPuts(w, buf);
+    }
+}
+
+// Load refseq [beg, end) of the current chromosome as the window, 
+// and tag the bases in it that earlier ROIs already counted
+//
+bool loadWindow(faidx_t *ref_fai, int64_t beg, int64_t end)
+{
+    int64_t len = 0;
+
+    if (data.ref_seq) free(data.ref_seq);
+
+    data.ref_seq = refWindowFetch(ref_fai, data.sam1->header->target_name[data.ref_id], beg, end, &len);
+
+    if (!data.ref_seq || len != end - beg)
+    {
+        fprintf(stderr, "Failed to fetch refseq %s:%lld-%lld\n", 
+                data.sam1->header->target_name[data.ref_id], (long long)beg+1, (long long)end);
+
+        if (data.ref_seq) free(data.ref_seq);
+        data.ref_seq = NULL;
+
+        return false;
+    }
+
+    data.ref_beg = beg;
+    data.ref_end = end;
+
+    //memset(data.bp_class, UNKNOWN, data.ref_len);
+    //set all UNKNOWN
+    //
+    memset(data.bp_class, data.unknown, end - beg);
+
+    // Only bases with context on both sides 
+    // are ever piled up in this window
+    //
+    size_t k;
+    int64_t pos;
+
+    for (k = seenFind(&data.seen, beg + 1); k < data.seen.n && data.seen.runs[k].beg < end - 1; ++k)
+    {
+        int64_t run_beg = (data.seen.runs[k].beg > beg + 1) ? data.seen.runs[k].beg : beg + 1;
+        int64_t run_end = (data.seen.runs[k].end < end - 1) ? data.seen.runs[k].end : end - 1;
+
+        for (pos = run_beg; pos < run_end; ++pos)
+        {
+            data.bp_class[pos - beg] = (char)classifyBase(&data, pos);
+        }
+    }
+
+    // Same for what each read group counted
+    //
+    int g;
+
+    for (g = 0; g < data.n_groups; ++g)
+    {
+        seen_set_t *set = &data.group_seen_set[g];
+        bool *seen = data.group_seen + g * data.win_len;
+
+        memset(seen, 0, (end - beg) * sizeof( bool ));
+
+        for (k = seenFind(set, beg); k < set->n && set->runs[k].beg < end; ++k)
+        {
+            int64_t run_beg = (set->runs[k].beg > beg) ? set->runs[k].beg : beg;
+            int64_t run_end = (set->runs[k].end < end) ? set->runs[k].end : end;
+
+            memset(seen + (run_beg - beg), 1, (run_end - run_beg) * sizeof( bool ));
+        }
+    }
+
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
 
+    // Companion command that stitches
+    // --shard outputs back together
+    //
+    if (argc > 1 && !strcmp(argv[1], "merge"))
+    {
+        return mergeShards(argc - 1, argv + 1);
+    }
+
     // shared across functions
     //
     data.ref_id   = -1;
@@ -106,6 +369,30 @@ int main(int argc, char *argv[])
         usage();
     }
 
+    if (argc - optind < 5)
+    {
+        fprintf(stderr, "Expected 5 arguments, got %d\n", argc - optind);
+        usage();
+    }
+
+    // A journal only resumes a run over the 
+    // same inputs with the same options
+    //
+    if (resume && ckpt.every == 0) ckpt.every = DEFAULT_CHECKPOINT_EVERY;
+
+    ckpt.path = (char*)malloc(strlen(argv[optind+4]) + 6);
+    sprintf(ckpt.path, "%s.ckpt", argv[optind+4]);
+
+    if (asprintf(&ckpt.args, "%s %s %s %s q=%d n=%d t=%d c=%s shard=%d/%d bgzip=%d group_by=%s group_map=%s depth=%s", 
+                 argv[optind], argv[optind+1], argv[optind+2], argv[optind+3],
+                 data.min_mapq, data.min_depth_bam1, data.min_depth_bam2, data.bp_class_types,
+                 shard_idx, shard_cnt, (int)bgzip,
+                 group_by ? group_by : "-", group_map ? group_map : "-",
+                 depth_cutoffs_arg ? depth_cutoffs_arg : "-") < 0)
+    {
+        return 1;
+    }
+
     // Open both BAM files and load their index files
     data.sam1 = samopen(argv[optind], "rb", 0);
     if (!data.sam1) fprintf(stderr, "Failed to open BAM file %s\n", argv[optind]);
@@ -127,8 +414,74 @@ int main(int argc, char *argv[])
     faidx_t *ref_fai = fai_load( argv[optind+3] );
     if (!ref_fai) fprintf(stderr, "Failed to open reference fasta file %s\n", argv[optind+3]);
 
-    // Open the output file to write to
-    FILE* outFp = fopen( argv[optind+4], "w" );
+    // Set up the read groups to count on their 
+    // own, from the BAM headers or the user's map
+    //
+    data.rg2group = kh_init(s);
+
+    if (data.sam1 && data.sam2)
+    {
+        if (group_map)
+        {
+            if (!groupsFromFile(&data, group_map)) return 1;
+        }
+        else if (group_by)
+        {
+            groupsFromHeader(&data, data.sam1->header, !strcasecmp(group_by, "LB"));
+            groupsFromHeader(&data, data.sam2->header, !strcasecmp(group_by, "LB"));
+        }
+
+        if ((group_map || group_by) && data.n_groups == 0)
+        {
+            fprintf(stderr, "No read groups found, only counting all reads together\n");
+        }
+        else if (data.n_groups && !groupsPaired(&data, data.sam1->header, data.sam2->header))
+        {
+            fprintf(stderr, "No read group is in both BAMs\n");
+            return 1;
+        }
+
+        groupsInit(&data);
+    }
+
+    int ckpt_ref_id = -1;
+    int64_t *ckpt_seen = NULL;
+    uint32_t ckpt_n_seen = 0;
+    bool resumed = false;
+
+    if (resume && access(ckpt.path, F_OK) == 0)
+    {
+        if (!ckptLoad(&ckpt, &data, &ckpt_ref_id, &ckpt_seen, &ckpt_n_seen))
+        {
+            fprintf(stderr, "Not resuming; remove %s to start over\n", ckpt.path);
+            return 1;
+        }
+
+        resumed = true;
+        fprintf(stderr, "Resuming after ROI %lu\n", (unsigned long)ckpt.roi_idx);
+    }
+
+    // Open the output file to write to. With bgzip the 
+    // chrom/start/end columns come right after RoiIdx.
+    // A resumed output is cut back to the checkpoint
+    //
+    roi_writer_t *outFp;
+
+    if (resumed)
+    {
+        outFp = wResume( argv[optind+4], ckpt.out_offset, bgzip, 
+                         shard_cnt ? 2 : 1, 
+                         shard_cnt ? 3 : 2, 
+                         shard_cnt ? 4 : 3 );
+    }
+    else
+    {
+        outFp = wOpen( argv[optind+4], bgzip, 
+                       shard_cnt ? 2 : 1, 
+                       shard_cnt ? 3 : 2, 
+                       shard_cnt ? 4 : 3 );
+    }
+
     if (!outFp) fprintf(stderr, "Failed to open output file %s\n", argv[optind+4]);
 
     // Show the user any and all errors they need to 
@@ -150,6 +503,7 @@ int main(int argc, char *argv[])
     data.bp_class_container = (char **)malloc((MAX_BP_CLASS_TYPES+1)*sizeof(char *));
 
     uint8_t i,j;
+    int g;
 
     for (i=0; i<=MAX_BP_CLASS_TYPES; i++)
     {
@@ -181,19 +535,105 @@ int main(int argc, char *argv[])
     // clean up
     kh_destroy(s, classTypeMap);
 
-    // Write a header with column titles 
-    // for the output file
-    fprintf( outFp, "#NOTE: Last line in file shows non-overlapping totals across all ROIs\n" );
-    fprintf( outFp, "#Gene\tROI\tLength\tCovered\t" );
+    // Fail fast on ROIs that would break the index
+    //
+    if (bgzip && !roisSorted(roiFp))
+    {
+        fprintf(stderr, "With --bgzip the ROI file must be sorted by start within each contig\n");
+        return 1;
+    }
 
-    // write output file header
+    // Pick this shard's ROIs up front, overlap 
+    // groups have to be known before counting
     //
-    for (i=0; i< (data.bp_class_number - 1); i++)
+    bool *roi_in_shard = NULL;
+    uint32_t roi_cnt = 0;
+
+    if (shard_cnt)
     {
-        fprintf( outFp, "%ss_Covered\t", data.bp_class_container[i] );
+        roi_in_shard = assignShards(roiFp, shard_idx, shard_cnt, &roi_cnt);
     }
 
-    fprintf( outFp, "%ss_Covered\n", data.bp_class_container[data.bp_class_number - 1] );
+    // Write a header with column titles 
+    // for the output file, unless resuming
+    //
+    if (!resumed)
+    {
+        wPutLine( outFp, "#NOTE: Last line in file shows non-overlapping totals across all ROIs" );
+
+        if (shard_cnt)
+        {
+            wPuts( outFp, SHARD_HEADER_TAG );
+            wPutc( outFp, '\t' );
+            wPutu( outFp, shard_idx );
+            wPutc( outFp, '/' );
+            wPutu( outFp, shard_cnt );
+            wEndLine( outFp );
+
+            wPuts( outFp, SHARD_INDEX_COLUMN );
+            wPutc( outFp, '\t' );
+        }
+        else
+        {
+            wPutc( outFp, '#' );
+        }
+
+        wPuts( outFp, bgzip ? "Chrom\tStart\tEnd\tGene\tLength\tCovered\t" : "Gene\tROI\tLength\tCovered\t" );
+
+        // write output file header
+        //
+        for (i=0; i< (data.bp_class_number - 1); i++)
+        {
+            wPuts( outFp, data.bp_class_container[i] );
+            wPuts( outFp, "s_Covered\t" );
+        }
+
+        wPuts( outFp, data.bp_class_container[data.bp_class_number - 1] );
+        wPuts( outFp, "s_Covered" );
+
+        // and the same columns per read group
+        //
+        for (g=0; g< data.n_groups; g++)
+        {
+            wPutc( outFp, '\t' );
+            wPuts( outFp, data.group_names[g] );
+            wPuts( outFp, "_Covered" );
+
+            for (i=0; i< data.bp_class_number; i++)
+            {
+                wPutc( outFp, '\t' );
+                wPuts( outFp, data.group_names[g] );
+                wPutc( outFp, '_' );
+                wPuts( outFp, data.bp_class_container[i] );
+                wPuts( outFp, "s_Covered" );
+            }
+        }
+
+        // and the depth stats of each BAM
+        //
+        for (g=0; n_depth_cutoffs && g<2; g++)
+        {
+            const char *bam = g ? "\tBam2_" : "\tBam1_";
+
+            wPuts( outFp, bam );
+            wPuts( outFp, "MeanDepth" );
+            wPuts( outFp, bam );
+            wPuts( outFp, "MedianDepth" );
+            wPuts( outFp, bam );
+            wPuts( outFp, "MinDepth" );
+            wPuts( outFp, bam );
+            wPuts( outFp, "MaxDepth" );
+
+            for (i=0; i<n_depth_cutoffs; i++)
+            {
+                wPuts( outFp, bam );
+                wPuts( outFp, "FracDepth>=" );
+                wPutu( outFp, depth_cutoffs[i] );
+            }
+        }
+
+        wEndLine( outFp );
+    }
 
     // bp class lengths
     // &&
@@ -213,15 +653,57 @@ int main(int argc, char *argv[])
     khash_t(s) *hdr_hash = (khash_t(s)*)data.sam1->header->hash;
     
     // Initialize the counters for the total number of 
-    // non-overlapping bases in all ROIs
+    // non-overlapping bases in all ROIs, unless they
+    // came from the checkpoint
+    //
+    if (!resumed)
+    {
+        data.tot_covd_bases = 0;
+
+        for (i=0; i<=data.bp_class_number; i++)
+        {
+            data.tot_base_cnt[i] = 0;
+        }
+
+        memset(data.tot_group_covd, 0, data.n_groups * sizeof( uint64_t ));
+        memset(data.tot_group_cnt, 0, data.n_groups * GROUP_CNT_STRIDE * sizeof( uint64_t ));
+    }
+
+    // The refseq window, its bp class tags and the bam1 
+    // coverage tags, sized by the memory budget
+    //
+    data.win_len  = refWindowLen(mem_budget << 20, REF_WINDOW_BYTES_PER_BASE + 2 * data.n_groups);
+    data.bp_class = (char*)malloc( data.win_len * sizeof( char ));
+    data.bam1_cvg = (bool*)malloc( data.win_len * sizeof( bool ));
+
+    data.group_cvg  = (bool*)malloc( data.n_groups * data.win_len * sizeof( bool ));
+    data.group_seen = (bool*)malloc( data.n_groups * data.win_len * sizeof( bool ));
+
+    if (n_depth_cutoffs)
+    {
+        data.depth_stats = (depth_stats_t*)malloc( 2 * sizeof( depth_stats_t ));
 
-    data.tot_covd_bases = 0;
+        depthInit(&data.depth_stats[0]);
+        depthInit(&data.depth_stats[1]);
+    }
 
-    for (i=0; i<=data.bp_class_number; i++)
+    // Take over the bases the interrupted run already 
+    // counted, so overlapping ROIs still skip them
+    //
+    if (resumed && ckpt_ref_id >= 0)
     {
-        data.tot_base_cnt[i] = 0;
+        uint32_t k;
+
+        data.ref_id = ckpt_ref_id;
+
+        for (k = 0; k < ckpt_n_seen; k += 2)
+        {
+            seenAdd(&data.seen, ckpt_seen[k], ckpt_seen[k+1]);
+        }
     }
 
+    if (ckpt_seen) free(ckpt_seen);
+
     //data.tot_covd_bases = data.tot_base_cnt[AT] 
     //                    = data.tot_base_cnt[CG] 
     //                    = data.tot_base_cnt[CpG] = 0;
@@ -231,21 +713,48 @@ int main(int argc, char *argv[])
     char ref_name[50];
     char gene_name[100];
 
+    unsigned long long roi_beg, roi_end;
+
     char *line = NULL;
     
     line = (char*)malloc(200);
+    length = 200;
+
+    // Index of the ROI among the well 
+    // formatted lines of the ROI file
+    //
+    uint32_t roi_idx = 0;
+
+    // Set once ROIs of the current chromosome go back 
+    // in start, which makes full windows a waste
+    //
+    bool stepped_back = false;
+
+    if (resumed)
+    {
+        fseeko(roiFp, ckpt.roi_offset, SEEK_SET);
+        roi_idx = ckpt.roi_idx;
+    }
     
     while (getline(&line, &length, roiFp) != -1)
     {
 
         if (
-                sscanf( line, "%s %lu %lu %s", ref_name, 
-                    (unsigned long *)&data.beg, 
-                    (unsigned long *)&data.end, gene_name ) == 4
+                sscanf( line, "%49s %llu %llu %99s", ref_name, 
+                    &roi_beg, 
+                    &roi_end, gene_name ) == 4
            )
         {
             int ref_id;
 
+            ++roi_idx;
+
+            // Another shard owns this ROI
+            if (roi_in_shard && (roi_idx > roi_cnt || !roi_in_shard[roi_idx - 1]))
+            {
+                continue;
+            }
+
             // If this region is valid in bam1,
             // we'll assume it's also valid in bam2
             
@@ -254,21 +763,30 @@ int main(int argc, char *argv[])
             if ( 
                  iter == kh_end(hdr_hash) 
                  || 
-                 data.beg > data.end 
+                 roi_beg == 0 
+                 || 
+                 roi_beg > roi_end 
+                 || 
+                 roi_end > data.sam1->header->target_len[kh_value( hdr_hash, iter )] 
                )
             {
                 fprintf(stderr, "Skipping invalid ROI: %s", line);
             }
+            else if (roi_end > MAX_BAM_LOCUS)
+            {
+                fprintf(stderr, "Skipping ROI past locus %d, which BAM indexes can't address: %s", MAX_BAM_LOCUS, line);
+            }
             else
             {
                 // Make the start locus a 
                 // 0-based coordinate
                 //
-                --data.beg; 
+                data.beg = (int64_t)roi_beg - 1; 
+                data.end = (int64_t)roi_end;
 
                 ref_id = kh_value( hdr_hash, iter );
                 
-                uint32_t bases = data.end - data.beg;
+                uint64_t bases = data.end - data.beg;
 
                 // data.covd_bases = data.base_cnt[AT] 
                 //                 = data.base_cnt[CG] 
@@ -283,55 +801,135 @@ int main(int argc, char *argv[])
                 {
                     data.base_cnt[i] = 0 ;
                 }
-                
-                // calloc also sets them to zero
-                data.bam1_cvg = (bool*)calloc( bases, sizeof( bool )); 
 
-                // Load this whole chromosome's refseq unless 
-                // already loaded for the previous ROI
+                memset(data.group_covd, 0, data.n_groups * sizeof( uint64_t ));
+                memset(data.group_cnt, 0, data.n_groups * GROUP_CNT_STRIDE * sizeof( uint64_t ));
+
+                if (data.depth_stats)
+                {
+                    depthReset(&data.depth_stats[0]);
+                    depthReset(&data.depth_stats[1]);
+                }
+                
+                // A new chromosome starts 
+                // with nothing counted
                 //
-                if (data.ref_seq == NULL || ref_id != data.ref_id)
+                if (ref_id != data.ref_id)
                 {
-                    if (data.ref_seq)  free(data.ref_seq);
-                    if (data.bp_class) free(data.bp_class);
+                    if (data.ref_seq) free(data.ref_seq);
+                    data.ref_seq = NULL;
 
-                    data.ref_seq = fai_fetch(ref_fai, data.sam1->header->target_name[ref_id], &data.ref_len);
-                    data.bp_class = (char*)malloc( data.ref_len * sizeof( char ));
+                    seenClear(&data.seen);
 
-                    //memset(data.bp_class, UNKNOWN, data.ref_len);
-                    //set all UNKNOWN
-                    //
-                    memset(data.bp_class, data.unknown, data.ref_len);
+                    for (g = 0; g < data.n_groups; g++)
+                    {
+                        seenClear(&data.group_seen_set[g]);
+                    }
 
                     data.ref_id = ref_id;
+                    stepped_back = false;
                 }
 
+                data.ref_len = data.sam1->header->target_len[ref_id];
+
                 // If the ROI is at a chromosome tip, edit it so 
                 // we can look for CpGs without segfaulting
                 //
                 if (data.beg == 0) ++data.beg;
                 if (data.end == data.ref_len) --data.end;
 
-                // Pileup bam1 and tag all the bases which 
-                // have sufficient read depth
-                 
-                // Initialize pileup 
-                bam_plbuf_t *buf1 = bam_plbuf_init(pileup_func_1, &data); 
+                int64_t roi_b = data.beg;
+                int64_t roi_e = data.end;
+                int64_t chunk_b, chunk_e;
 
-                bam_fetch(data.sam1->x.bam, idx1, ref_id, data.beg, data.end, buf1, fetch_func);
-
-                bam_plbuf_push(0, buf1);
-                bam_plbuf_destroy(buf1);
+                // Stream the ROI through the refseq window in chunks 
+                // that leave a base of context on either side
+                //
+                for (chunk_b = roi_b; chunk_b < roi_e; chunk_b = chunk_e)
+                {
+                    chunk_e = chunk_b + data.win_len - 2;
 
-                // Pileup bam2 and count bases with sufficient 
-                // read depth, and tagged earlier in bam1
+                    if (chunk_e > roi_e) chunk_e = roi_e;
 
-                // Initialize pileup
-                bam_plbuf_t *buf2 = bam_plbuf_init(pileup_func_2, &data); 
-                bam_fetch(data.sam2->x.bam, idx2, ref_id, data.beg, data.end, buf2, fetch_func);
+                    // Reload the window unless 
+                    // the chunk is inside it
+                    //
+                    if (data.ref_seq == NULL || chunk_b - 1 < data.ref_beg || chunk_e + 1 > data.ref_end)
+                    {
+                        int64_t win_e = chunk_b - 1 + data.win_len;
+
+                        if (data.ref_seq && chunk_b - 1 < data.ref_beg) stepped_back = true;
+
+                        // Then the next ROI may be anywhere, so only 
+                        // fetch through this one (and a little more)
+                        //
+                        if (stepped_back)
+                        {
+                            int64_t need = roi_e + 1;
+
+                            if (need < chunk_b - 1 + REF_WINDOW_MIN_LEN) need = chunk_b - 1 + REF_WINDOW_MIN_LEN;
+                            if (need < win_e) win_e = need;
+                        }
+
+                        if (win_e > data.ref_len) win_e = data.ref_len;
+
+                        // Partial counts would pass for a whole 
+                        // ROI in the output and the totals
+                        //
+                        if (!loadWindow(ref_fai, chunk_b - 1, win_e)) return 1;
+                    }
+
+                    data.beg = chunk_b;
+                    data.end = chunk_e;
+
+                    memset(data.bam1_cvg, 0, (chunk_e - chunk_b) * sizeof( bool ));
+
+                    for (g = 0; g < data.n_groups; g++)
+                    {
+                        memset(data.group_cvg + g * data.win_len, 0, (chunk_e - chunk_b) * sizeof( bool ));
+                    }
+
+                    // Pileup bam1 and tag all the bases which 
+                    // have sufficient read depth
+                     
+                    // Initialize pileup 
+                    bam_plbuf_t *buf1 = bam_plbuf_init(pileup_func_1, &data); 
+                    group_fetch_t fetch1 = { buf1, &data };
+
+                    if (data.n_groups)
+                    {
+                        bam_fetch(data.sam1->x.bam, idx1, ref_id, data.beg, data.end, &fetch1, fetch_group_func);
+                    }
+                    else
+                    {
+                        bam_fetch(data.sam1->x.bam, idx1, ref_id, data.beg, data.end, buf1, fetch_func);
+                    }
+
+                    bam_plbuf_push(0, buf1);
+                    bam_plbuf_destroy(buf1);
+
+                    // Pileup bam2 and count bases with sufficient 
+                    // read depth, and tagged earlier in bam1
+
+                    // Initialize pileup
+                    bam_plbuf_t *buf2 = bam_plbuf_init(pileup_func_2, &data); 
+                    group_fetch_t fetch2 = { buf2, &data };
+
+                    if (data.n_groups)
+                    {
+                        bam_fetch(data.sam2->x.bam, idx2, ref_id, data.beg, data.end, &fetch2, fetch_group_func);
+                    }
+                    else
+                    {
+                        bam_fetch(data.sam2->x.bam, idx2, ref_id, data.beg, data.end, buf2, fetch_func);
+                    }
+
+                    bam_plbuf_push(0, buf2);
+                    bam_plbuf_destroy(buf2);
+                }
 
-                bam_plbuf_push(0, buf2);
-                bam_plbuf_destroy(buf2);
+                data.beg = roi_b;
+                data.end = roi_e;
                 
                 //fprintf( outFp, "%s\t%s:%lu-%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n",
                 //        gene_name,
@@ -345,20 +943,86 @@ int main(int argc, char *argv[])
                 //        (unsigned long)data.base_cnt[CpG] );
                 //
 
-                fprintf(outFp, "%s\t%s:%lu-%lu\t%lu\t%lu\t", gene_name, ref_name,
-                        (unsigned long)data.beg+1, 
-                        (unsigned long)data.end, 
-                        (unsigned long)bases,
-                        (unsigned long)data.covd_bases);
+                if (shard_cnt)
+                {
+                    wPutu(outFp, roi_idx - 1);
+                    wPutc(outFp, '\t');
+                }
+
+                // Sortable chrom/start/end columns for tabix, 
+                // or the packed chr:beg-end ROI column
+                //
+                if (bgzip)
+                {
+                    wPuts(outFp, ref_name);
+                    wPutc(outFp, '\t');
+                    wPutu(outFp, data.beg+1);
+                    wPutc(outFp, '\t');
+                    wPutu(outFp, data.end);
+                    wPutc(outFp, '\t');
+                    wPuts(outFp, gene_name);
+                    wPutc(outFp, '\t');
+                }
+                else
+                {
+                    wPuts(outFp, gene_name);
+                    wPutc(outFp, '\t');
+                    wPuts(outFp, ref_name);
+                    wPutc(outFp, ':');
+                    wPutu(outFp, data.beg+1);
+                    wPutc(outFp, '-');
+                    wPutu(outFp, data.end);
+                    wPutc(outFp, '\t');
+                }
+
+                wPutu(outFp, bases);
+                wPutc(outFp, '\t');
+                wPutu(outFp, data.covd_bases);
 
-                for (j=0; j<(data.bp_class_number - 1); j++)         
+                for (j=0; j<data.bp_class_number; j++)         
                 {
-                    fprintf(outFp, "%lu\t", (unsigned long)data.base_cnt[j]);
+                    wPutc(outFp, '\t');
+                    wPutu(outFp, data.base_cnt[j]);
                 }
 
-                fprintf(outFp, "%lu\n", (unsigned long)data.base_cnt[data.bp_class_number - 1]);
+                for (g=0; g<data.n_groups; g++)
+                {
+                    wPutc(outFp, '\t');
+                    wPutu(outFp, data.group_covd[g]);
+
+                    for (j=0; j<data.bp_class_number; j++)
+                    {
+                        wPutc(outFp, '\t');
+                        wPutu(outFp, data.group_cnt[g * GROUP_CNT_STRIDE + j]);
+                    }
+                }
+
+                // over the bases actually piled up, 
+                // chromosome tips left out
+                //
+                if (data.depth_stats)
+                {
+                    putDepthStats(outFp, &data.depth_stats[0], roi_e - roi_b);
+                    putDepthStats(outFp, &data.depth_stats[1], roi_e - roi_b);
+                }
 
-                free(data.bam1_cvg);
+                if (wEndLine(outFp) != 0) return 1;
+
+                // Journal everything up to and including 
+                // this ROI every ckpt.every ROIs
+                //
+                if (ckpt.every && ++ckpt.pending >= ckpt.every)
+                {
+                    ckpt.roi_idx = roi_idx;
+                    ckpt.roi_offset = ftello(roiFp);
+                    ckpt.out_offset = wSync(outFp);
+                    ckpt.pending = 0;
+
+                    if (ckptSave(&ckpt, &data) != 0)
+                    {
+                        fprintf(stderr, "Failed to write checkpoint %s\n", ckpt.path);
+                    }
+                }
 
             }
         }
@@ -384,14 +1048,42 @@ int main(int argc, char *argv[])
     //        (unsigned long)data.tot_base_cnt[CG],
     //        (unsigned long)data.tot_base_cnt[CpG] );
 
-    fprintf(outFp, "#NonOverlappingTotals\t\t\t%lu\t", (unsigned long)data.tot_covd_bases);
+    // The tag sits in the first column, RoiIdx 
+    // for a shard, so the counts line up below
+    // their header
+    //
+    wPuts(outFp, TOTALS_TAG);
+    if (shard_cnt) wPutc(outFp, '\t');
+    wPuts(outFp, bgzip ? "\t\t\t\t\t" : "\t\t\t");
+    wPutu(outFp, data.tot_covd_bases);
     
-    for (j=0; j<(data.bp_class_number - 1); j++)
+    for (j=0; j<data.bp_class_number; j++)
+    {
+        wPutc(outFp, '\t');
+        wPutu(outFp, data.tot_base_cnt[j]);
+    }
+
+    for (g=0; g<data.n_groups; g++)
+    {
+        wPutc(outFp, '\t');
+        wPutu(outFp, data.tot_group_covd[g]);
+
+        for (j=0; j<data.bp_class_number; j++)
+        {
+            wPutc(outFp, '\t');
+            wPutu(outFp, data.tot_group_cnt[g * GROUP_CNT_STRIDE + j]);
+        }
+    }
+
+    // Depth stats are per ROI only, 
+    // their columns stay empty
+    //
+    for (j=0; n_depth_cutoffs && j<2 * (4 + n_depth_cutoffs); j++)
     {
-        fprintf(outFp, "%lu\t", (unsigned long)data.tot_base_cnt[j]);
+        wPutc(outFp, '\t');
     }
 
-    fprintf(outFp, "%lu\n", (unsigned long)data.tot_base_cnt[data.bp_class_number - 1]);
+    wEndLine(outFp);
 
     // Cleanup
     //
@@ -411,9 +1103,21 @@ int main(int argc, char *argv[])
     }
 
     if (line) free(line);
+    if (roi_in_shard) free(roi_in_shard);
 
     if (data.ref_seq) free(data.ref_seq);
     if (data.bp_class) free(data.bp_class);
+    if (data.bam1_cvg) free(data.bam1_cvg);
+
+    seenFree(&data.seen);
+    groupsFree(&data);
+
+    if (data.depth_stats)
+    {
+        depthFree(&data.depth_stats[0]);
+        depthFree(&data.depth_stats[1]);
+        free(data.depth_stats);
+    }
 
     bam_index_destroy( idx1 );
     bam_index_destroy( idx2 );
@@ -424,7 +1128,20 @@ int main(int argc, char *argv[])
     fai_destroy( ref_fai );
     
     fclose( roiFp );
-    fclose( outFp );
+
+    if (wClose( outFp ) != 0)
+    {
+        fprintf(stderr, "Failed to write output file %s\n", argv[optind+4]);
+        return 1;
+    }
+
+    // The output is complete, a later 
+    // --resume has nothing to continue
+    //
+    if (ckpt.every) unlink(ckpt.path);
+
+    free(ckpt.path);
+    free(ckpt.args);
 
     return 0;
 
@@ -22,6 +22,8 @@
 #include "sam.h"
 #include "faidx.h"
 #include "khash.h"
+#include "refWindow.h"
+#include "depthStats.h"
 
 // Set bp class container
 // 
@@ -41,6 +43,11 @@
 #define MAX_BP_CLASS_TYPES 100
 #define MAX_BP_CLASS 11
 
+// Per group class counts are laid out as 
+// [group][class], classes through IUB
+//
+#define GROUP_CNT_STRIDE (MAX_BP_CLASS_TYPES + 1)
+
 KHASH_MAP_INIT_STR(s, int)
 
 // Initializes the header hash in 
@@ -57,9 +64,11 @@ enum bp_class_t { AT, CG, CpG, IUB, UNKNOWN };
 
 typedef struct
 {
-    // The start and stop of a region of interest
-    uint32_t beg;
-    uint32_t end;
+    // The start and stop of the part of a region 
+    // of interest being piled up
+    //
+    int64_t beg;
+    int64_t end;
     
     // Minimum mapping quality of the reads to pileup
     int min_mapq; 
@@ -74,34 +83,47 @@ typedef struct
     
     // Counts bases in a region that has the 
     // minimum read depth in both bams
-    uint32_t covd_bases; 
+    uint64_t covd_bases; 
 
     // Counts covered bases in an ROI of 4 bp-classes 
     // AT, CG, CpG, IUB
     //uint32_t base_cnt[4]; 
     //
     // extend to 100 class tyes
-    uint32_t base_cnt[MAX_BP_CLASS_TYPES];
+    uint64_t base_cnt[MAX_BP_CLASS_TYPES];
 
     // Counts bases in all ROIs that have the 
     // minimum read depth in both bams
-    uint32_t tot_covd_bases;
+    uint64_t tot_covd_bases;
 
     // Counts covered bases in all ROIs of 4 bp-classes 
     // AT, CG, CpG, IUB
     //uint32_t tot_base_cnt[4];
     //
     // extend to 100 class tyes 
-    uint32_t tot_base_cnt[MAX_BP_CLASS_TYPES];
+    uint64_t tot_base_cnt[MAX_BP_CLASS_TYPES];
 
-    // Contains the reference sequence for the entire 
-    // chromosome a region lies in
+    // Contains the reference sequence [ref_beg, ref_end) 
+    // of the chromosome a region lies in, a window of 
+    // at most win_len bases rather than all of it
+    //
     char *ref_seq;
+    int64_t ref_beg;
+    int64_t ref_end;
+    int64_t win_len;
 
-    // This prevents counting the same base twice when ROIs 
+    // The bp class of the bases in the window that were 
+    // already counted, UNKNOWN for the others. This 
+    // prevents counting the same base twice when ROIs 
     // overlap in a chromosome
+    //
     char *bp_class; 
 
+    // All the bases of the chromosome 
+    // counted so far, window or not
+    //
+    seen_set_t seen;
+
     // user customize bp class types
     char *bp_class_types;
     char **bp_class_container;
@@ -114,12 +136,47 @@ typedef struct
     // A chromosome's ID in the the BAM header hash, 
     // and it's length
     int ref_id;
-    int ref_len; 
+    int64_t ref_len; 
     
     // The two bam files that need to be piled-up
     samfile_t *sam1;
     samfile_t *sam2; 
 
+    // Read groups counted on their own, none unless 
+    // --group-by or --group-map is given
+    //
+    int n_groups;
+    char **group_names;
+    khash_t(s) *rg2group;
+
+    // Reads of each group passing the mapping 
+    // quality at the current position
+    //
+    int *group_depth;
+
+    // Per group bam1 coverage tags of the chunk being 
+    // piled up, and already counted tags of the 
+    // window, both [group][base]
+    //
+    bool *group_cvg;
+    bool *group_seen;
+
+    // Per group counted runs of the chromosome
+    seen_set_t *group_seen_set;
+
+    // Per group ROI and total counts 
+    // of covered bases, and by class
+    //
+    uint64_t *group_covd;
+    uint64_t *group_cnt;
+    uint64_t *tot_group_covd;
+    uint64_t *tot_group_cnt;
+
+    // Depth summaries of the ROI for bam1 and 
+    // bam2, NULL unless --depth-stats is given
+    //
+    depth_stats_t *depth_stats;
+
 } pileup_data_t;
 
 // get class type 
@@ -155,6 +212,71 @@ static bool getClass( char pre,
 
 }
 
+// Classify the refseq base at pos into one of 
+// the user's bp classes, or IUB if none matches
+//
+static int classifyBase(pileup_data_t *tmp, int64_t pos)
+{
+    uint8_t j;
+
+    const char *ref = tmp->ref_seq + (pos - tmp->ref_beg);
+
+    char base = toupper(ref[0]);
+    char prev_base = toupper(ref[-1]);
+    char next_base = toupper(ref[1]);
+
+    for (j=0; j<tmp->iub; ++j)
+    {
+        if ( getClass( prev_base, 
+                            base, 
+                       next_base, 
+                       tmp->bp_class_container[j], 
+                       tmp->bp_class_lengths[j] ) )
+        {
+            return j;
+        }
+
+    }
+
+    return tmp->iub;
+
+}
+
+
+// Group of a read from its RG tag, 
+// -1 if it is in none
+//
+static int readGroup(pileup_data_t *tmp, const bam1_t *b)
+{
+    uint8_t *rg = bam_aux_get(b, "RG");
+
+    if (!rg) return -1;
+
+    khiter_t k = kh_get(s, tmp->rg2group, bam_aux2Z(rg));
+
+    return (k == kh_end(tmp->rg2group)) ? -1 : kh_value(tmp->rg2group, k);
+}
+
+// Count the reads of each group passing the 
+// mapping quality threshold across this base
+//
+static void countGroupDepth(pileup_data_t *tmp, int n, const bam_pileup1_t *pl)
+{
+    int i;
+
+    memset(tmp->group_depth, 0, tmp->n_groups * sizeof(int));
+
+    for (i = 0; i < n; ++i)
+    {
+        const bam_pileup1_t *base = pl + i;
+
+        // group + 1 as tagged by fetch_group_func()
+        if (!base->is_del && base->b->core.qual >= tmp->min_mapq && base->b->core.bin)
+        {
+            ++tmp->group_depth[base->b->core.bin - 1];
+        }
+    }
+}
 
 // Callback for bam_fetch() pushed only alignments 
 // that pass the minimum mapping quality
@@ -171,6 +293,33 @@ static int fetch_func(const bam1_t *b, void *data)
     return 0;
 }
 
+// bam_fetch() data when counting read groups
+typedef struct
+{
+    bam_plbuf_t *buf;
+    pileup_data_t *tmp;
+
+} group_fetch_t;
+
+// Callback for bam_fetch() when counting read groups. The group of 
+// an alignment is looked up once here instead of at every base it 
+// covers, and kept as group + 1 (0 for none) in core.bin, which the 
+// pileup copies along but never reads
+//
+static int fetch_group_func(const bam1_t *b, void *data)
+{
+    group_fetch_t *fetch = (group_fetch_t*)data;
+
+    // reads under the mapping quality 
+    // never count towards a group
+    //
+    ((bam1_t*)b)->core.bin = (b->core.qual >= fetch->tmp->min_mapq) ? readGroup(fetch->tmp, b) + 1 : 0;
+
+    bam_plbuf_push(b, fetch->buf);
+
+    return 0;
+}
+
 // Callback for bam_plbuf_init() when running a pileup on bam1
 static int pileup_func_1(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t *pl, void *data)
 {
@@ -185,7 +334,7 @@ static int pileup_func_1(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t
         
     // openmp parallel 
     omp_set_num_threads( 2 );
-#pragma omp parallel for
+#pragma omp parallel for reduction(+:mapq_n)
          
         for (i = 0; i < n; ++i)
         {
@@ -197,6 +346,23 @@ static int pileup_func_1(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t
         }
         
         tmp->bam1_cvg[pos - tmp->beg] = (mapq_n >= tmp->min_depth_bam1);
+
+        if (tmp->depth_stats) depthAdd(&tmp->depth_stats[0], mapq_n);
+
+        // A group can only reach the depth 
+        // where all reads together do
+        //
+        if (tmp->n_groups && mapq_n >= tmp->min_depth_bam1)
+        {
+            int g;
+
+            countGroupDepth(tmp, n, pl);
+
+            for (g = 0; g < tmp->n_groups; ++g)
+            {
+                tmp->group_cvg[g * tmp->win_len + (pos - tmp->beg)] = (tmp->group_depth[g] >= tmp->min_depth_bam1);
+            }
+        }
     }
     
     return 0;
@@ -208,19 +374,20 @@ static int pileup_func_2(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t
 {
     pileup_data_t *tmp = (pileup_data_t*)data;
 
-    if (pos >= tmp->beg && pos < tmp->end && tmp->bam1_cvg[pos - tmp->beg])
+    // Bases missing in bam1 are only 
+    // piled up for the depth stats
+    //
+    if (pos >= tmp->beg && pos < tmp->end && (tmp->bam1_cvg[pos - tmp->beg] || tmp->depth_stats))
     {
         // Count the number of reads that pass the mapping 
         // quality threshold across this base
         //
         int i;
         int mapq_n = 0;
-        
-        uint8_t j;
 
     // openmp parallel 
     omp_set_num_threads( 2 );
-#pragma omp parallel for
+#pragma omp parallel for reduction(+:mapq_n)
         for (i = 0; i <n; ++i)
         {
             const bam_pileup1_t *base = pl + i;
@@ -231,43 +398,16 @@ static int pileup_func_2(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t
 
         }
 
-        if (mapq_n >= tmp->min_depth_bam2)
-        {
+        if (tmp->depth_stats) depthAdd(&tmp->depth_stats[1], mapq_n);
 
-            int class = (int)(tmp->bp_class[pos]);
+        if (tmp->bam1_cvg[pos - tmp->beg] && mapq_n >= tmp->min_depth_bam2)
+        {
 
-            // default IUB 
-            bool notiub = false;
-            bool isHit  = false;
+            int class = (int)(tmp->bp_class[pos - tmp->ref_beg]);
 
             if (class == tmp->unknown)
             {
-
-                char base = toupper(tmp->ref_seq[pos]);
-                char prev_base = toupper(tmp->ref_seq[pos-1]);
-                char next_base = toupper(tmp->ref_seq[pos+1]);
-
-                for (j=0; j<tmp->iub; ++j)
-                {
-                    isHit = getClass( prev_base, 
-                                           base, 
-                                      next_base, 
-                                      tmp->bp_class_container[j], 
-                                      tmp->bp_class_lengths[j] );
-
-                    if (isHit)
-                    {
-                        notiub = true;
-                        class = j;
-                        break;
-                    }
-
-                }
-
-                if (!notiub)
-                {
-                    class = tmp->iub;
-                }
+                class = classifyBase(tmp, pos);
 
                 ++tmp->covd_bases;
                 ++tmp->base_cnt[class];
@@ -277,7 +417,8 @@ static int pileup_func_2(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t
                 // Tag this as seen and save its class 
                 // for an overlapping ROI
                 //
-                tmp->bp_class[pos] = (char)class;
+                tmp->bp_class[pos - tmp->ref_beg] = (char)class;
+                seenAdd(&tmp->seen, pos, pos + 1);
 
             }
             else
@@ -286,6 +427,34 @@ static int pileup_func_2(uint32_t tid, uint32_t pos, int n, const bam_pileup1_t
                 ++tmp->base_cnt[class];
             }
 
+            // The same test again on each group's 
+            // own reads, with its own dedup
+            //
+            if (tmp->n_groups)
+            {
+                int g;
+                int64_t off = pos - tmp->ref_beg;
+
+                countGroupDepth(tmp, n, pl);
+
+                for (g = 0; g < tmp->n_groups; ++g)
+                {
+                    if (!tmp->group_cvg[g * tmp->win_len + (pos - tmp->beg)] || tmp->group_depth[g] < tmp->min_depth_bam2) continue;
+
+                    ++tmp->group_covd[g];
+                    ++tmp->group_cnt[g * GROUP_CNT_STRIDE + class];
+
+                    if (!tmp->group_seen[g * tmp->win_len + off])
+                    {
+                        ++tmp->tot_group_covd[g];
+                        ++tmp->tot_group_cnt[g * GROUP_CNT_STRIDE + class];
+
+                        tmp->group_seen[g * tmp->win_len + off] = true;
+                        seenAdd(&tmp->group_seen_set[g], pos, pos + 1);
+                    }
+                }
+            }
+
         }
     }
 
@@ -0,0 +1,145 @@
+/// Description: Per ROI read-depth summaries (mean, median, min, max and
+///              the fraction of bases at or above depth cutoffs) of a BAM
+/// Notes:
+/// - Depth is the same count the thresholds are tested on: reads passing
+///   the mapping quality that are not a deletion at the base
+/// - Every depth goes into a histogram as it is piled up, so nothing per
+///   base is kept. Bases the pileup never reports have depth 0. Depths
+///   past DEPTH_HIST_MAX share the last bin, which only limits the median
+//
+
+#ifndef DEPTH_STATS_H
+#define DEPTH_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Highest depth with a histogram
+// bin of its own
+//
+#define DEPTH_HIST_MAX 65535
+
+#define MAX_DEPTH_CUTOFFS 16
+
+typedef struct
+{
+    // bases per depth, and the highest
+    // bin used since the last reset
+    //
+    uint64_t *hist;
+    uint32_t top;
+
+    // bases reported by the pileup,
+    // their depth sum and range
+    //
+    uint64_t n;
+    uint64_t sum;
+    uint32_t min;
+    uint32_t max;
+
+} depth_stats_t;
+
+static void depthInit(depth_stats_t *st)
+{
+    st->hist = (uint64_t*)calloc(DEPTH_HIST_MAX + 1, sizeof(uint64_t));
+    st->top = 0;
+    st->n = st->sum = 0;
+    st->min = st->max = 0;
+}
+
+static void depthFree(depth_stats_t *st)
+{
+    free(st->hist);
+    st->hist = NULL;
+}
+
+// Start over for the next ROI, only
+// clearing the bins that were used
+//
+static void depthReset(depth_stats_t *st)
+{
+    memset(st->hist, 0, (st->top + 1) * sizeof(uint64_t));
+    st->top = 0;
+    st->n = st->sum = 0;
+    st->min = st->max = 0;
+}
+
+static inline void depthAdd(depth_stats_t *st, uint32_t depth)
+{
+    uint32_t bin = (depth > DEPTH_HIST_MAX) ? DEPTH_HIST_MAX : depth;
+
+    ++st->hist[bin];
+    if (bin > st->top) st->top = bin;
+
+    if (st->n == 0 || depth < st->min) st->min = depth;
+    if (depth > st->max) st->max = depth;
+
+    ++st->n;
+    st->sum += depth;
+}
+
+// Bases of the len in the ROI with depth of at least
+// cutoff, counting the unreported ones as depth 0
+//
+static uint64_t depthAtLeast(const depth_stats_t *st, uint64_t len, uint32_t cutoff)
+{
+    uint64_t cnt = 0;
+    uint32_t d;
+
+    if (cutoff == 0) return len;
+
+    for (d = cutoff; d <= st->top; ++d) cnt += st->hist[d];
+
+    return cnt;
+}
+
+// Lower median depth over len bases
+//
+static uint32_t depthMedian(const depth_stats_t *st, uint64_t len)
+{
+    uint64_t zeros = len - st->n;
+    uint64_t half = (len + 1) / 2;
+    uint64_t cum = zeros + st->hist[0];
+    uint32_t d = 0;
+
+    while (cum < half && d < st->top) cum += st->hist[++d];
+
+    return d;
+}
+
+static uint32_t depthMin(const depth_stats_t *st, uint64_t len)
+{
+    return (st->n < len) ? 0 : st->min;
+}
+
+// Depth cutoffs as a comma delimited list,
+// e.g. "1,10,20,30"
+//
+static bool parseDepthCutoffs(const char *arg, uint32_t *cutoffs, int *n)
+{
+    const char *p = arg;
+    char *q;
+
+    *n = 0;
+
+    while (*p)
+    {
+        unsigned long c = strtoul(p, &q, 10);
+
+        if (q == p || c > DEPTH_HIST_MAX || *n == MAX_DEPTH_CUTOFFS) return false;
+
+        cutoffs[(*n)++] = (uint32_t)c;
+
+        if (*q == ',') ++q;
+        else if (*q) return false;
+
+        p = q;
+    }
+
+    return *n > 0;
+}
+
+#endif
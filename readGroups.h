@@ -0,0 +1,266 @@
+/// Description: Read group setup for counting coverage per read group,
+///              per library, or per user defined group of read groups
+/// Notes:
+/// - A group is evaluated like a BAM pair of its own: a base is covered
+///   in group G if bam1's reads of G reach the bam1 depth and bam2's
+///   reads of G reach the bam2 depth. Groups with RG IDs that only occur
+///   in one of the BAMs can never be covered, so a tumor/normal pair
+///   with distinct IDs needs a group map that puts them together
+/// - Reads without an RG tag, or with an RG outside every group, still
+///   count towards the combined columns
+//
+
+#ifndef READ_GROUPS_H
+#define READ_GROUPS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Upper bound on groups, each adds output columns. 
+// Group + 1 has to fit in the 16 bits of core.bin
+//
+#define MAX_READ_GROUPS 256
+
+// Index of the group called label,
+// added if it is new
+//
+static int addGroup(pileup_data_t *tmp, const char *label)
+{
+    int i;
+
+    for (i = 0; i < tmp->n_groups; ++i)
+    {
+        if (!strcmp(tmp->group_names[i], label)) return i;
+    }
+
+    if (tmp->n_groups == MAX_READ_GROUPS)
+    {
+        fprintf(stderr, "More than %d read groups, ignoring %s\n", MAX_READ_GROUPS, label);
+        return -1;
+    }
+
+    tmp->group_names = (char**)realloc(tmp->group_names, (tmp->n_groups + 1) * sizeof(char*));
+    tmp->group_names[tmp->n_groups] = strdup(label);
+
+    return tmp->n_groups++;
+}
+
+// Send reads of RG id to group g. The first
+// mapping of an id wins
+//
+static void mapReadGroup(pileup_data_t *tmp, const char *id, int g)
+{
+    int ret;
+
+    if (g < 0) return;
+
+    khiter_t k = kh_put(s, tmp->rg2group, id, &ret);
+
+    if (ret)
+    {
+        kh_key(tmp->rg2group, k) = strdup(id);
+        kh_value(tmp->rg2group, k) = g;
+    }
+}
+
+// Copy the value of tag (e.g. "ID:") out of one tab
+// delimited @RG header line, never past its end
+//
+static bool rgField(const char *line, const char *tag, char *value, size_t size)
+{
+    const char *p = line;
+    const char *eol = line + strcspn(line, "\n");
+    size_t l_tag = strlen(tag);
+
+    while ((p = strchr(p, '\t')) != NULL && p < eol)
+    {
+        ++p;
+
+        if (!strncmp(p, tag, l_tag))
+        {
+            size_t len = strcspn(p + l_tag, "\t\n");
+
+            if (len >= size) len = size - 1;
+
+            memcpy(value, p + l_tag, len);
+            value[len] = '\0';
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// One group per @RG ID, or per library (LB, falling back
+// to the ID) with by_library, over the header's @RG lines
+//
+static void groupsFromHeader(pileup_data_t *tmp, const bam_header_t *header, bool by_library)
+{
+    const char *line = header->text;
+    char id[256], lb[256];
+
+    while (line && line < header->text + header->l_text)
+    {
+        if (!strncmp(line, "@RG\t", 4) && rgField(line, "ID:", id, sizeof(id)))
+        {
+            if (!by_library || !rgField(line, "LB:", lb, sizeof(lb))) strcpy(lb, id);
+
+            mapReadGroup(tmp, id, addGroup(tmp, by_library ? lb : id));
+        }
+
+        line = strchr(line, '\n');
+
+        if (line) ++line;
+    }
+}
+
+// Group map file: tab delimited [RG ID, group],
+// one read group per line
+//
+static bool groupsFromFile(pileup_data_t *tmp, const char *fn)
+{
+    FILE *fp = fopen(fn, "r");
+
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to open read group map %s\n", fn);
+        return false;
+    }
+
+    size_t length = 0;
+    char *line = NULL;
+    char id[256], label[256];
+
+    while (getline(&line, &length, fp) != -1)
+    {
+        if (line[0] == '#') continue;
+
+        if (sscanf(line, "%255s %255s", id, label) == 2)
+        {
+            mapReadGroup(tmp, id, addGroup(tmp, label));
+        }
+        else if (strspn(line, " \t\r\n") != strlen(line))
+        {
+            fprintf(stderr, "Badly formatted read group map line: %s", line);
+            fprintf(stderr, "\nRead group map should be a tab-delimited list of [RG ID, group]\n");
+
+            free(line);
+            fclose(fp);
+
+            return false;
+        }
+    }
+
+    if (line) free(line);
+    fclose(fp);
+
+    return true;
+}
+
+// Flag in in_bam[g] the groups that read groups 
+// of this header belong to
+//
+static void groupsInHeader(pileup_data_t *tmp, const bam_header_t *header, uint8_t flag, uint8_t *in_bam)
+{
+    const char *line = header->text;
+    char id[256];
+
+    while (line && line < header->text + header->l_text)
+    {
+        if (!strncmp(line, "@RG\t", 4) && rgField(line, "ID:", id, sizeof(id)))
+        {
+            khiter_t k = kh_get(s, tmp->rg2group, id);
+
+            if (k != kh_end(tmp->rg2group)) in_bam[kh_value(tmp->rg2group, k)] |= flag;
+        }
+
+        line = strchr(line, '\n');
+
+        if (line) ++line;
+    }
+}
+
+// A group can only be covered with reads in both BAMs. Warn about 
+// groups missing from one, and fail if that leaves no group at all
+//
+static bool groupsPaired(pileup_data_t *tmp, const bam_header_t *header1, const bam_header_t *header2)
+{
+    uint8_t *in_bam = (uint8_t*)calloc(tmp->n_groups, sizeof(uint8_t));
+    int g, n_paired = 0;
+
+    groupsInHeader(tmp, header1, 1, in_bam);
+    groupsInHeader(tmp, header2, 2, in_bam);
+
+    for (g = 0; g < tmp->n_groups; ++g)
+    {
+        if (in_bam[g] == 3)
+        {
+            ++n_paired;
+        }
+        else
+        {
+            fprintf(stderr, "Read group %s is %s, so it can never be covered\n", tmp->group_names[g],
+                    in_bam[g] == 1 ? "only in bam1" : in_bam[g] == 2 ? "only in bam2" : "in neither BAM header");
+        }
+    }
+
+    free(in_bam);
+
+    if (n_paired < tmp->n_groups)
+    {
+        fprintf(stderr, "Use -G with a map of [RG ID, group] to put read groups of bam1 and bam2 together\n");
+    }
+
+    return n_paired > 0;
+}
+
+// Per group counters and scratch space. The window
+// tags are allocated with the refseq window
+//
+static void groupsInit(pileup_data_t *tmp)
+{
+    int n = tmp->n_groups;
+
+    tmp->group_depth = (int*)calloc(n, sizeof(int));
+    tmp->group_seen_set = (seen_set_t*)calloc(n, sizeof(seen_set_t));
+
+    tmp->group_covd = (uint64_t*)calloc(n, sizeof(uint64_t));
+    tmp->group_cnt = (uint64_t*)calloc(n * GROUP_CNT_STRIDE, sizeof(uint64_t));
+    tmp->tot_group_covd = (uint64_t*)calloc(n, sizeof(uint64_t));
+    tmp->tot_group_cnt = (uint64_t*)calloc(n * GROUP_CNT_STRIDE, sizeof(uint64_t));
+}
+
+static void groupsFree(pileup_data_t *tmp)
+{
+    int g;
+    khiter_t k;
+
+    for (g = 0; g < tmp->n_groups; ++g)
+    {
+        free(tmp->group_names[g]);
+        seenFree(&tmp->group_seen_set[g]);
+    }
+
+    for (k = kh_begin(tmp->rg2group); k != kh_end(tmp->rg2group); ++k)
+    {
+        if (kh_exist(tmp->rg2group, k)) free((char*)kh_key(tmp->rg2group, k));
+    }
+
+    kh_destroy(s, tmp->rg2group);
+
+    free(tmp->group_names);
+    free(tmp->group_depth);
+    free(tmp->group_seen_set);
+    free(tmp->group_cvg);
+    free(tmp->group_seen);
+    free(tmp->group_covd);
+    free(tmp->group_cnt);
+    free(tmp->tot_group_covd);
+    free(tmp->tot_group_cnt);
+}
+
+#endif
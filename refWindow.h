@@ -0,0 +1,184 @@
+/// Description: Windowed access to a reference contig, and the set of
+///              bases already counted on it
+/// Notes:
+/// - Instead of holding a whole chromosome (and one bp_class byte per
+///   base of it), calcRoiCovg keeps a bounded window of the refseq and
+///   streams ROIs through it in chunks. Windows are fetched with one
+///   extra base on each side so XpY context is available at the edges
+/// - Bases counted towards the non-overlapping totals are kept as sorted
+///   runs, so that memory grows with the covered bases in ROIs rather
+///   than with contig length. ROIs sorted by start only ever extend or
+///   append to the last run
+//
+
+#ifndef REF_WINDOW_H
+#define REF_WINDOW_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+#include "faidx.h"
+
+// Bytes of memory the window takes per base:
+// refseq, bp_class and the bam1 coverage tag.
+// Per group tags come on top of this
+//
+#define REF_WINDOW_BYTES_PER_BASE 3
+
+// Smallest window worth
+// the fetch overhead
+//
+#define REF_WINDOW_MIN_LEN 4096
+
+// Half open run [beg, end) of counted bases
+typedef struct
+{
+    int64_t beg;
+    int64_t end;
+
+} seen_run_t;
+
+typedef struct
+{
+    size_t n, m;
+    seen_run_t *runs;
+
+    // run touched last, where a sorted
+    // pileup is most likely to continue
+    //
+    size_t hint;
+
+} seen_set_t;
+
+static void seenClear(seen_set_t *set)
+{
+    set->n = 0;
+    set->hint = 0;
+}
+
+static void seenFree(seen_set_t *set)
+{
+    free(set->runs);
+    set->runs = NULL;
+    set->n = set->m = set->hint = 0;
+}
+
+// Index of the first run
+// that ends after pos
+//
+static size_t seenFind(const seen_set_t *set, int64_t pos)
+{
+    size_t lo = 0, hi = set->n;
+
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) >> 1;
+
+        if (set->runs[mid].end <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+// Glue run i to run i+1
+// if they now touch
+//
+static void seenJoin(seen_set_t *set, size_t i)
+{
+    if (i + 1 < set->n && set->runs[i].end >= set->runs[i+1].beg)
+    {
+        if (set->runs[i+1].end > set->runs[i].end) set->runs[i].end = set->runs[i+1].end;
+
+        memmove(set->runs + i + 1, set->runs + i + 2, (set->n - i - 2) * sizeof(seen_run_t));
+        --set->n;
+    }
+}
+
+// Add [beg, end) to the set
+//
+static void seenAdd(seen_set_t *set, int64_t beg, int64_t end)
+{
+    if (end <= beg) return;
+
+    // Fast path: right where the last
+    // addition left off
+    //
+    if (set->hint < set->n && set->runs[set->hint].end == beg
+        && (set->hint + 1 == set->n || set->runs[set->hint + 1].beg > end))
+    {
+        set->runs[set->hint].end = end;
+        return;
+    }
+
+    size_t i = seenFind(set, beg);
+
+    if (i > 0 && set->runs[i-1].end == beg) --i;
+
+    if (i < set->n && set->runs[i].beg <= end)
+    {
+        // overlaps or touches run i
+        if (beg < set->runs[i].beg) set->runs[i].beg = beg;
+
+        if (end > set->runs[i].end)
+        {
+            set->runs[i].end = end;
+
+            while (i + 1 < set->n && set->runs[i+1].beg <= set->runs[i].end)
+            {
+                seenJoin(set, i);
+            }
+        }
+    }
+    else
+    {
+        if (set->n == set->m)
+        {
+            set->m = set->m ? set->m << 1 : 256;
+            set->runs = (seen_run_t*)realloc(set->runs, set->m * sizeof(seen_run_t));
+        }
+
+        memmove(set->runs + i + 1, set->runs + i, (set->n - i) * sizeof(seen_run_t));
+
+        set->runs[i].beg = beg;
+        set->runs[i].end = end;
+        ++set->n;
+    }
+
+    set->hint = i;
+}
+
+// Window length in bases that fits a memory
+// budget given in bytes
+//
+static int64_t refWindowLen(uint64_t budget, int bytes_per_base)
+{
+    uint64_t len = budget / bytes_per_base;
+
+    if (len < REF_WINDOW_MIN_LEN) len = REF_WINDOW_MIN_LEN;
+    if (len > INT_MAX) len = INT_MAX;
+
+    return (int64_t)len;
+}
+
+// Fetch refseq [beg, end) of a contig. faidx
+// takes int loci with an inclusive end
+//
+static char *refWindowFetch(const faidx_t *fai, char *name, int64_t beg, int64_t end, int64_t *len)
+{
+    int l = 0;
+
+    if (beg < 0 || end <= beg || end - 1 > INT_MAX) return NULL;
+
+    char *seq = faidx_fetch_seq(fai, name, (int)beg, (int)(end - 1), &l);
+
+    *len = l;
+
+    return seq;
+}
+
+#endif
@@ -0,0 +1,263 @@
+/// Description: Checkpoint journal, so that a killed or preempted run can
+///              pick up after the last ROI it finished
+/// Notes:
+/// - The journal sits next to the output as <output_file>.ckpt and is
+///   replaced atomically (write to .tmp, fsync, rename). It is removed
+///   once the run completes
+/// - It records how far into the ROI file and the output we got, the
+///   running non-overlapping totals, and the runs of bases of the current
+///   contig that were already counted. The class of a counted base follows
+///   from the refseq alone, so the refseq window rebuilds bp_class from
+///   those runs on resume
+/// - With read groups, the totals and counted runs of each group follow
+///   as group_totals and group_seen lines
+//
+
+#ifndef ROI_CHECKPOINT_H
+#define ROI_CHECKPOINT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC "#calcRoiCovg checkpoint v1"
+
+typedef struct
+{
+    // <output_file>.ckpt
+    char *path;
+
+    // Inputs and options the output depends on; 
+    // a journal written with others is not resumed
+    //
+    char *args;
+
+    // Write a checkpoint every this many ROIs,
+    // 0 turns checkpointing off
+    //
+    uint32_t every;
+    uint32_t pending;
+
+    // Where the last checkpoint left off: well formatted ROI lines
+    // read, byte offset into the ROI file, offset into the output
+    //
+    uint32_t roi_idx;
+    int64_t roi_offset;
+    int64_t out_offset;
+
+} roi_checkpoint_t;
+
+// Write a new journal for the state in data
+//
+static int ckptSave(roi_checkpoint_t *ck, pileup_data_t *data)
+{
+    char *tmp = (char*)malloc(strlen(ck->path) + 5);
+    size_t i;
+    int g;
+
+    sprintf(tmp, "%s.tmp", ck->path);
+
+    FILE *fp = fopen(tmp, "w");
+
+    if (!fp)
+    {
+        free(tmp);
+        return -1;
+    }
+
+    fprintf(fp, "%s\n", CHECKPOINT_MAGIC);
+    fprintf(fp, "args\t%s\n", ck->args);
+    fprintf(fp, "roi\t%lu\t%lld\n", (unsigned long)ck->roi_idx, (long long)ck->roi_offset);
+    fprintf(fp, "output\t%lld\n", (long long)ck->out_offset);
+    fprintf(fp, "totals\t%llu", (unsigned long long)data->tot_covd_bases);
+
+    // through IUB, so it survives
+    // a resume as well
+    //
+    for (i = 0; i <= data->iub; ++i)
+    {
+        fprintf(fp, "\t%llu", (unsigned long long)data->tot_base_cnt[i]);
+    }
+
+    fprintf(fp, "\ncontig\t%d\n", data->ref_id);
+
+    // Runs of bases already counted
+    // in the current contig
+    //
+    for (i = 0; i < data->seen.n; ++i)
+    {
+        fprintf(fp, "seen\t%lld\t%lld\n", (long long)data->seen.runs[i].beg, (long long)data->seen.runs[i].end);
+    }
+
+    for (g = 0; g < data->n_groups; ++g)
+    {
+        fprintf(fp, "group_totals\t%d\t%llu", g, (unsigned long long)data->tot_group_covd[g]);
+
+        for (i = 0; i <= data->iub; ++i)
+        {
+            fprintf(fp, "\t%llu", (unsigned long long)data->tot_group_cnt[g * GROUP_CNT_STRIDE + i]);
+        }
+
+        fprintf(fp, "\n");
+
+        for (i = 0; i < data->group_seen_set[g].n; ++i)
+        {
+            fprintf(fp, "group_seen\t%d\t%lld\t%lld\n", g, 
+                    (long long)data->group_seen_set[g].runs[i].beg, (long long)data->group_seen_set[g].runs[i].end);
+        }
+    }
+
+    fprintf(fp, "end\n");
+
+    int ret = 0;
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) ret = -1;
+    if (fclose(fp) != 0) ret = -1;
+    if (ret == 0 && rename(tmp, ck->path) != 0) ret = -1;
+
+    free(tmp);
+
+    return ret;
+
+}
+
+// Read the journal back. Totals and the group runs go straight into
+// data, the covered runs of the journal's contig into seen (pairs of
+// [beg, end)), and the contig id into ref_id. False if there is no 
+// usable journal
+//
+static bool ckptLoad(roi_checkpoint_t *ck, pileup_data_t *data, int *ref_id, int64_t **seen, uint32_t *n_seen)
+{
+    FILE *fp = fopen(ck->path, "r");
+
+    if (!fp) return false;
+
+    size_t length = 0;
+    char *line = NULL;
+
+    bool ok = false, has_args = false, has_roi = false, has_output = false, has_totals = false;
+    uint32_t m_seen = 0;
+    int g;
+
+    *seen = NULL;
+    *n_seen = 0;
+    *ref_id = -1;
+
+    if (getline(&line, &length, fp) == -1 || strncmp(line, CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC)))
+    {
+        fprintf(stderr, "%s is not a calcRoiCovg checkpoint\n", ck->path);
+        goto done;
+    }
+
+    while (getline(&line, &length, fp) != -1)
+    {
+        unsigned long a;
+        long long off, b, e;
+        int n;
+
+        line[strcspn(line, "\n")] = '\0';
+
+        if (!strncmp(line, "args\t", 5))
+        {
+            if (strcmp(line + 5, ck->args))
+            {
+                fprintf(stderr, "Checkpoint %s was written with other options (%s)\n", ck->path, line + 5);
+                goto done;
+            }
+
+            has_args = true;
+        }
+        else if (sscanf(line, "roi\t%lu\t%lld", &a, &off) == 2)
+        {
+            ck->roi_idx = a;
+            ck->roi_offset = off;
+            has_roi = true;
+        }
+        else if (sscanf(line, "output\t%lld", &off) == 1)
+        {
+            ck->out_offset = off;
+            has_output = true;
+        }
+        else if (!strncmp(line, "totals\t", 7))
+        {
+            char *p = line + 7, *q;
+            uint32_t i;
+
+            data->tot_covd_bases = strtoull(p, &q, 10);
+
+            // the args line already made sure
+            // the class count is the same
+            //
+            for (i = 0; i < MAX_BP_CLASS_TYPES && *q; ++i)
+            {
+                p = q;
+                data->tot_base_cnt[i] = strtoull(p, &q, 10);
+
+                if (q == p) goto done;
+            }
+
+            has_totals = true;
+        }
+        else if (sscanf(line, "contig\t%d", ref_id) == 1)
+        {
+            continue;
+        }
+        else if (sscanf(line, "seen\t%lld\t%lld", &b, &e) == 2)
+        {
+            if (*n_seen + 2 > m_seen)
+            {
+                m_seen = m_seen ? m_seen << 1 : 256;
+                *seen = (int64_t*)realloc(*seen, m_seen * sizeof(int64_t));
+            }
+
+            (*seen)[(*n_seen)++] = b;
+            (*seen)[(*n_seen)++] = e;
+        }
+        else if (sscanf(line, "group_totals\t%d%n", &g, &n) == 1 && g >= 0 && g < data->n_groups)
+        {
+            char *p = line + n, *q;
+            uint32_t i;
+
+            data->tot_group_covd[g] = strtoull(p, &q, 10);
+
+            for (i = 0; i < MAX_BP_CLASS_TYPES && *q; ++i)
+            {
+                p = q;
+                data->tot_group_cnt[g * GROUP_CNT_STRIDE + i] = strtoull(p, &q, 10);
+
+                if (q == p) goto done;
+            }
+        }
+        else if (sscanf(line, "group_seen\t%d\t%lld\t%lld", &g, &b, &e) == 3 && g >= 0 && g < data->n_groups)
+        {
+            seenAdd(&data->group_seen_set[g], b, e);
+        }
+        else if (!strcmp(line, "end"))
+        {
+            ok = has_args && has_roi && has_output && has_totals;
+        }
+    }
+
+    if (!ok) fprintf(stderr, "Checkpoint %s is incomplete\n", ck->path);
+
+done:
+    if (line) free(line);
+    fclose(fp);
+
+    if (!ok)
+    {
+        free(*seen);
+        *seen = NULL;
+        *n_seen = 0;
+
+        for (g = 0; g < data->n_groups; ++g) seenClear(&data->group_seen_set[g]);
+    }
+
+    return ok;
+
+}
+
+#endif
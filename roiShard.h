@@ -0,0 +1,465 @@
+/// Description: Splits the ROIs into shards for cluster runs, and merges
+///              the per-shard outputs back into one file
+/// Notes:
+/// - ROIs that overlap (directly or through a chain of overlaps) always go
+///   to the same shard, so each shard's bp_class dedup sees every ROI that
+///   could share a base with its own. The shard's #NonOverlappingTotals are
+///   then exact for a disjoint set of bases, and the global totals are the
+///   plain sum of the shard totals
+/// - Shards are balanced by total ROI bases, largest overlap group first
+//
+
+#ifndef ROI_SHARD_H
+#define ROI_SHARD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "roiWriter.h"
+
+#define SHARD_HEADER_TAG "#Shard"
+#define SHARD_INDEX_COLUMN "#RoiIdx"
+#define TOTALS_TAG "#NonOverlappingTotals"
+
+// One well formatted line of the ROI file,
+// 0-based half open
+//
+typedef struct
+{
+    char *ref_name;
+    uint64_t beg;
+    uint64_t end;
+    uint32_t idx;
+
+} roi_span_t;
+
+// Order ROIs by contig name and
+// then by start locus
+//
+static int cmpRoiSpan(const void *a, const void *b)
+{
+    const roi_span_t *x = (const roi_span_t*)a;
+    const roi_span_t *y = (const roi_span_t*)b;
+
+    int c = strcmp(x->ref_name, y->ref_name);
+
+    if (c) return c;
+    if (x->beg != y->beg) return (x->beg < y->beg) ? -1 : 1;
+
+    return (x->idx < y->idx) ? -1 : (x->idx > y->idx);
+}
+
+// Heaviest overlap group first, ties
+// broken by group id to stay deterministic
+//
+static uint64_t *shard_group_weights;
+
+static int cmpGroupWeight(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+
+    if (shard_group_weights[x] != shard_group_weights[y])
+    {
+        return (shard_group_weights[x] > shard_group_weights[y]) ? -1 : 1;
+    }
+
+    return (x < y) ? -1 : (x > y);
+}
+
+// Parse "i/N" with 1 <= i <= N
+//
+static bool parseShard(const char *arg, int *shard_idx, int *shard_cnt)
+{
+    char tail = '\n';
+
+    int n = sscanf(arg, "%d/%d%c", shard_idx, shard_cnt, &tail);
+
+    if (n < 2 || !isspace((unsigned char)tail)) return false;
+
+    return (*shard_cnt >= 1 && *shard_idx >= 1 && *shard_idx <= *shard_cnt);
+}
+
+// Read every well formatted ROI of roiFp and tag the ones that belong
+// to shard shard_idx (1-based) out of shard_cnt. The returned array is
+// indexed by the ROI's position among the well formatted lines, and its
+// length is stored in roi_cnt. The file is rewound before returning
+//
+static bool *assignShards(FILE *roiFp, int shard_idx, int shard_cnt, uint32_t *roi_cnt)
+{
+    size_t length = 0;
+    char *line = NULL;
+
+    char ref_name[50];
+    char gene_name[100];
+    unsigned long long beg, end;
+
+    uint32_t n = 0, m = 1024;
+    roi_span_t *rois = (roi_span_t*)malloc(m * sizeof(roi_span_t));
+
+    // Stop at the first badly formatted line, the main
+    // loop reports it and quits there anyway
+    //
+    while (getline(&line, &length, roiFp) != -1)
+    {
+        if (sscanf(line, "%49s %llu %llu %99s", ref_name, &beg, &end, gene_name) != 4) break;
+
+        if (n == m)
+        {
+            m <<= 1;
+            rois = (roi_span_t*)realloc(rois, m * sizeof(roi_span_t));
+        }
+
+        rois[n].ref_name = strdup(ref_name);
+        rois[n].beg = (beg > 0) ? beg - 1 : 0;
+        rois[n].end = end;
+        rois[n].idx = n;
+        ++n;
+    }
+
+    if (line) free(line);
+    rewind(roiFp);
+
+    // Sweep each contig in start order, and chain ROIs
+    // into one group while they keep overlapping
+    //
+    qsort(rois, n, sizeof(roi_span_t), cmpRoiSpan);
+
+    uint32_t *group = (uint32_t*)malloc((n + 1) * sizeof(uint32_t));
+    uint64_t *weight = (uint64_t*)calloc(n + 1, sizeof(uint64_t));
+    uint32_t n_groups = 0;
+    uint64_t group_end = 0;
+    uint32_t i;
+
+    for (i = 0; i < n; ++i)
+    {
+        if (i == 0
+            || strcmp(rois[i].ref_name, rois[i-1].ref_name)
+            || rois[i].beg >= group_end)
+        {
+            ++n_groups;
+            group_end = rois[i].end;
+        }
+        else if (rois[i].end > group_end)
+        {
+            group_end = rois[i].end;
+        }
+
+        group[rois[i].idx] = n_groups - 1;
+
+        if (rois[i].end > rois[i].beg)
+        {
+            weight[n_groups - 1] += rois[i].end - rois[i].beg;
+        }
+    }
+
+    // Longest processing time first: hand out the heaviest
+    // groups to whichever shard is lightest so far
+    //
+    uint32_t *order = (uint32_t*)malloc((n_groups + 1) * sizeof(uint32_t));
+    int *group_shard = (int*)malloc((n_groups + 1) * sizeof(int));
+    uint64_t *load = (uint64_t*)calloc(shard_cnt, sizeof(uint64_t));
+
+    for (i = 0; i < n_groups; ++i) order[i] = i;
+
+    shard_group_weights = weight;
+    qsort(order, n_groups, sizeof(uint32_t), cmpGroupWeight);
+    shard_group_weights = NULL;
+
+    for (i = 0; i < n_groups; ++i)
+    {
+        int s, lightest = 0;
+
+        for (s = 1; s < shard_cnt; ++s)
+        {
+            if (load[s] < load[lightest]) lightest = s;
+        }
+
+        group_shard[order[i]] = lightest;
+        load[lightest] += weight[order[i]];
+    }
+
+    bool *in_shard = (bool*)malloc((n + 1) * sizeof(bool));
+
+    for (i = 0; i < n; ++i)
+    {
+        in_shard[i] = (group_shard[group[i]] == shard_idx - 1);
+    }
+
+    fprintf(stderr, "Shard %d/%d: %lu bases in ROIs\n", shard_idx, shard_cnt,
+            (unsigned long)load[shard_idx - 1]);
+
+    for (i = 0; i < n; ++i) free(rois[i].ref_name);
+
+    free(rois);
+    free(group);
+    free(weight);
+    free(order);
+    free(group_shard);
+    free(load);
+
+    *roi_cnt = n;
+
+    return in_shard;
+
+}
+
+// One ROI line of a shard output, without its index column
+//
+typedef struct
+{
+    uint32_t idx;
+    char *row;
+
+} shard_row_t;
+
+static int cmpShardRow(const void *a, const void *b)
+{
+    uint32_t x = ((const shard_row_t*)a)->idx;
+    uint32_t y = ((const shard_row_t*)b)->idx;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+// Add the tab delimited counts of one shard's totals line to the
+// running sums. Empty fields stay empty in the merged line. Returns
+// the number of fields, only the first max_fields are added
+//
+static int addTotals(const char *fields, uint64_t *sums, bool *filled, int max_fields)
+{
+    int k = 0;
+    const char *p = fields;
+
+    while (true)
+    {
+        const char *tab = strchr(p, '\t');
+        size_t len = tab ? (size_t)(tab - p) : strcspn(p, "\n");
+
+        if (len > 0 && k < max_fields)
+        {
+            sums[k] += strtoull(p, NULL, 10);
+            filled[k] = true;
+        }
+
+        ++k;
+
+        if (!tab) break;
+        p = tab + 1;
+    }
+
+    return k;
+}
+
+// calcRoiCovg merge <output_file> <shard_output>...
+//
+// Concatenates the ROI lines of all shards in original ROI order and
+// writes the summed non-overlapping totals. Bgzipped shards give a
+// bgzipped and tabix indexed merge
+//
+static int mergeShards(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "\nUsage: calcRoiCovg merge <output_file> <shard_output>...\n\n");
+        return 1;
+    }
+
+    int n_files = argc - 2;
+    int shard_cnt = 0;
+    bool *seen_shard = NULL;
+
+    char *columns = NULL;
+
+    size_t n_rows = 0, m_rows = 1024;
+    shard_row_t *rows = (shard_row_t*)malloc(m_rows * sizeof(shard_row_t));
+
+    // Sized from the column header: a shard's totals line has a field
+    // for every column after RoiIdx, where its tag sits. The merged
+    // line drops the first, as its tag takes that column instead
+    //
+    uint64_t *sums = NULL;
+    bool *filled = NULL;
+    int n_fields = 0;
+
+    bool bgzip = false;
+    char *line = NULL;
+    int f;
+
+    for (f = 0; f < n_files; ++f)
+    {
+        const char *fn = argv[f + 2];
+        bool shard_bgzip = false;
+        roi_reader_t *fp = rOpen(fn, &shard_bgzip);
+
+        if (!fp)
+        {
+            fprintf(stderr, "Failed to open shard output %s\n", fn);
+            return 1;
+        }
+
+        if (f > 0 && shard_bgzip != bgzip)
+        {
+            fprintf(stderr, "Shard outputs mix plain and bgzipped files (%s)\n", fn);
+            return 1;
+        }
+
+        bgzip = shard_bgzip;
+
+        bool has_shard = false, has_totals = false;
+
+        while ((line = rGetLine(fp)) != NULL)
+        {
+            size_t tag = strcspn(line, "\t\n");
+
+            if (tag == strlen(SHARD_HEADER_TAG) && !strncmp(line, SHARD_HEADER_TAG, tag))
+            {
+                int i, n;
+
+                if (!parseShard(line + tag + 1, &i, &n) || (shard_cnt && n != shard_cnt))
+                {
+                    fprintf(stderr, "Bad shard header in %s: %s", fn, line);
+                    return 1;
+                }
+
+                if (!shard_cnt)
+                {
+                    shard_cnt = n;
+                    seen_shard = (bool*)calloc(n, sizeof(bool));
+                }
+
+                if (seen_shard[i - 1])
+                {
+                    fprintf(stderr, "Shard %d/%d given twice (%s)\n", i, n, fn);
+                    return 1;
+                }
+
+                seen_shard[i - 1] = has_shard = true;
+            }
+            else if (tag == strlen(SHARD_INDEX_COLUMN) && !strncmp(line, SHARD_INDEX_COLUMN, tag))
+            {
+                if (!columns)
+                {
+                    const char *c;
+
+                    columns = strdup(line + tag + 1);
+
+                    for (c = columns, n_fields = 1; *c && *c != '\n'; ++c) n_fields += (*c == '\t');
+
+                    sums = (uint64_t*)calloc(n_fields, sizeof(uint64_t));
+                    filled = (bool*)calloc(n_fields, sizeof(bool));
+                }
+                else if (strcmp(columns, line + tag + 1))
+                {
+                    fprintf(stderr, "Column layout of %s differs from the other shards\n", fn);
+                    return 1;
+                }
+            }
+            else if (tag == strlen(TOTALS_TAG) && !strncmp(line, TOTALS_TAG, tag))
+            {
+                if (!columns)
+                {
+                    fprintf(stderr, "%s has a totals line before its column header\n", fn);
+                    return 1;
+                }
+
+                int k = addTotals(line + tag + 1, sums, filled, n_fields);
+
+                if (k != n_fields)
+                {
+                    fprintf(stderr, "Totals line of %s has %d fields, the columns call for %d\n", fn, k, n_fields);
+                    return 1;
+                }
+
+                has_totals = true;
+            }
+            else if (line[0] != '#' && tag > 0)
+            {
+                if (n_rows == m_rows)
+                {
+                    m_rows <<= 1;
+                    rows = (shard_row_t*)realloc(rows, m_rows * sizeof(shard_row_t));
+                }
+
+                rows[n_rows].idx = (uint32_t)strtoul(line, NULL, 10);
+                rows[n_rows].row = strdup(line + tag + 1);
+                ++n_rows;
+            }
+        }
+
+        rClose(fp);
+
+        if (!has_shard || !has_totals)
+        {
+            fprintf(stderr, "%s is not a complete shard output (run with --shard)\n", fn);
+            return 1;
+        }
+    }
+
+    if (n_files != shard_cnt)
+    {
+        fprintf(stderr, "Expected %d shard outputs, got %d\n", shard_cnt, n_files);
+        return 1;
+    }
+
+    // Without the index column the bgzip
+    // layout starts with chrom/start/end
+    //
+    roi_writer_t *outFp = wOpen(argv[1], bgzip, 1, 2, 3);
+
+    if (!outFp)
+    {
+        fprintf(stderr, "Failed to open output file %s\n", argv[1]);
+        return 1;
+    }
+
+    qsort(rows, n_rows, sizeof(shard_row_t), cmpShardRow);
+
+    wPutLine(outFp, "#NOTE: Last line in file shows non-overlapping totals across all ROIs");
+    wPutc(outFp, '#');
+    wPutLine(outFp, columns);
+
+    size_t r;
+
+    for (r = 0; r < n_rows; ++r)
+    {
+        if (wPutLine(outFp, rows[r].row) != 0)
+        {
+            fprintf(stderr, "Merge bgzip shards of ROIs sorted by start within each contig, or plain text ones\n");
+            return 1;
+        }
+
+        free(rows[r].row);
+    }
+
+    wPuts(outFp, TOTALS_TAG);
+
+    for (f = 1; f < n_fields; ++f)
+    {
+        wPutc(outFp, '\t');
+
+        if (filled[f]) wPutu(outFp, sums[f]);
+    }
+
+    wEndLine(outFp);
+
+    if (wClose(outFp) != 0)
+    {
+        fprintf(stderr, "Failed to write output file %s\n", argv[1]);
+        return 1;
+    }
+
+    free(rows);
+    free(columns);
+    free(seen_shard);
+    free(sums);
+    free(filled);
+
+    return 0;
+
+}
+
+#endif
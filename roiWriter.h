@@ -0,0 +1,727 @@
+/// Description: Buffered output writer for calcRoiCovg, plain text or
+///              bgzip-compressed with a tabix-compatible (.tbi) index
+/// Notes:
+/// - Lines are assembled in memory with a hand rolled integer formatter
+///   and handed to stdio/BGZF in large chunks, instead of one fprintf
+///   per column
+/// - Every line that does not start with '#' is indexed on the fly from
+///   its chrom/start/end columns (1-based start, like tabix -p generic),
+///   so `tabix out.gz chr:beg-end` works without a separate indexing pass
+/// - Tabix stops reading a contig at the first line that starts past the
+///   query, so lines have to come grouped by contig and sorted by start.
+///   A line that breaks this order fails the write instead of leaving an
+///   index that silently misses records
+//
+
+#ifndef ROI_WRITER_H
+#define ROI_WRITER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "bgzf.h"
+#include "khash.h"
+
+// Plain text output is handed to stdio
+// once this much has piled up
+//
+#define WRITER_FLUSH_SIZE 0x10000
+
+// Tabix linear index window, 16kbp
+#define TBX_LIDX_SHIFT 14
+
+// The .tbi binning only covers
+// loci below 2^29
+//
+#define TBX_MAX_LOCUS (1 << 29)
+
+// Chunks of virtual file offsets
+// belonging to one bin
+//
+typedef struct
+{
+    uint64_t u, v;
+
+} tbx_chunk_t;
+
+typedef struct
+{
+    int n, m;
+    tbx_chunk_t *list;
+
+} tbx_bin_t;
+
+KHASH_MAP_INIT_INT(tbx_bin, tbx_bin_t)
+
+// Binning and linear index of one contig
+typedef struct
+{
+    char *name;
+    khash_t(tbx_bin) *bins;
+
+    int n_intv;
+    uint64_t *ioff;
+
+} tbx_ref_t;
+
+typedef struct
+{
+    // 1-based columns holding chrom, start and end
+    int col_seq;
+    int col_beg;
+    int col_end;
+
+    int n_refs, m_refs;
+    tbx_ref_t *refs;
+
+    // contig name to refs[] slot
+    khash_t(s) *ref_hash;
+    int last_ref;
+
+    // start of the last line indexed
+    unsigned long last_beg;
+
+} tbx_index_t;
+
+typedef struct
+{
+    // exactly one of these is open
+    FILE *fp;
+    BGZF *bgzf;
+
+    char *path;
+
+    // the line(s) being assembled
+    char *buf;
+    size_t len;
+    size_t cap;
+
+    // only for bgzip output
+    tbx_index_t *tbi;
+
+} roi_writer_t;
+
+// Same binning scheme as BAM,
+// 0-based half open interval
+//
+static inline int tbxReg2bin(uint32_t beg, uint32_t end)
+{
+    --end;
+
+    if (beg>>14 == end>>14) return 4681 + (beg>>14);
+    if (beg>>17 == end>>17) return  585 + (beg>>17);
+    if (beg>>20 == end>>20) return   73 + (beg>>20);
+    if (beg>>23 == end>>23) return    9 + (beg>>23);
+    if (beg>>26 == end>>26) return    1 + (beg>>26);
+
+    return 0;
+}
+
+static tbx_index_t *tbxInit(int col_seq, int col_beg, int col_end)
+{
+    tbx_index_t *idx = (tbx_index_t*)calloc(1, sizeof(tbx_index_t));
+
+    idx->col_seq = col_seq;
+    idx->col_beg = col_beg;
+    idx->col_end = col_end;
+    idx->ref_hash = kh_init(s);
+    idx->last_ref = -1;
+
+    return idx;
+}
+
+static tbx_ref_t *tbxGetRef(tbx_index_t *idx, const char *name, size_t l_name)
+{
+    if (idx->last_ref >= 0
+        && strlen(idx->refs[idx->last_ref].name) == l_name
+        && !strncmp(idx->refs[idx->last_ref].name, name, l_name))
+    {
+        return idx->refs + idx->last_ref;
+    }
+
+    char *key = strndup(name, l_name);
+    int ret;
+
+    khiter_t k = kh_put(s, idx->ref_hash, key, &ret);
+
+    if (ret)
+    {
+        if (idx->n_refs == idx->m_refs)
+        {
+            idx->m_refs = idx->m_refs ? idx->m_refs << 1 : 16;
+            idx->refs = (tbx_ref_t*)realloc(idx->refs, idx->m_refs * sizeof(tbx_ref_t));
+        }
+
+        tbx_ref_t *r = idx->refs + idx->n_refs;
+
+        r->name = key;
+        r->bins = kh_init(tbx_bin);
+        r->n_intv = 0;
+        r->ioff = NULL;
+
+        kh_value(idx->ref_hash, k) = idx->n_refs++;
+    }
+    else
+    {
+        free(key);
+    }
+
+    idx->last_ref = kh_value(idx->ref_hash, k);
+
+    return idx->refs + idx->last_ref;
+}
+
+// Record that [beg, end) of a contig was
+// written between virtual offsets u and v
+//
+static void tbxAdd(tbx_ref_t *r, uint32_t beg, uint32_t end, uint64_t u, uint64_t v)
+{
+    if (end <= beg) end = beg + 1;
+
+    int ret;
+    khiter_t k = kh_put(tbx_bin, r->bins, tbxReg2bin(beg, end), &ret);
+    tbx_bin_t *bin = &kh_value(r->bins, k);
+
+    if (ret)
+    {
+        bin->n = bin->m = 0;
+        bin->list = NULL;
+    }
+
+    // Records written back to back
+    // share one chunk
+    //
+    if (bin->n && bin->list[bin->n - 1].v == u)
+    {
+        bin->list[bin->n - 1].v = v;
+    }
+    else
+    {
+        if (bin->n == bin->m)
+        {
+            bin->m = bin->m ? bin->m << 1 : 4;
+            bin->list = (tbx_chunk_t*)realloc(bin->list, bin->m * sizeof(tbx_chunk_t));
+        }
+
+        bin->list[bin->n].u = u;
+        bin->list[bin->n].v = v;
+        ++bin->n;
+    }
+
+    // First record of each window
+    int w, w_beg = beg >> TBX_LIDX_SHIFT, w_end = (end - 1) >> TBX_LIDX_SHIFT;
+
+    if (w_end >= r->n_intv)
+    {
+        r->ioff = (uint64_t*)realloc(r->ioff, (w_end + 1) * sizeof(uint64_t));
+        memset(r->ioff + r->n_intv, 0, (w_end + 1 - r->n_intv) * sizeof(uint64_t));
+        r->n_intv = w_end + 1;
+    }
+
+    for (w = w_beg; w <= w_end; ++w)
+    {
+        if (r->ioff[w] == 0 || r->ioff[w] > u) r->ioff[w] = u;
+    }
+}
+
+// Pull chrom/start/end out of one data line and add it to the 
+// index. Fails on a line out of order or past TBX_MAX_LOCUS
+//
+static int tbxAddLine(tbx_index_t *idx, const char *line, size_t len, uint64_t u, uint64_t v)
+{
+    const char *name = NULL;
+    size_t l_name = 0;
+    unsigned long beg = 0, end = 0;
+
+    const char *p = line, *q;
+    int col = 1;
+
+    while (p < line + len)
+    {
+        for (q = p; q < line + len && *q != '\t' && *q != '\n'; ++q);
+
+        if (col == idx->col_seq)
+        {
+            name = p;
+            l_name = q - p;
+        }
+        else if (col == idx->col_beg)
+        {
+            beg = strtoul(p, NULL, 10);
+        }
+        else if (col == idx->col_end)
+        {
+            end = strtoul(p, NULL, 10);
+        }
+
+        if (q >= line + len || *q == '\n') break;
+
+        p = q + 1;
+        ++col;
+    }
+
+    if (!name || beg == 0) return 0;
+
+    if (beg > TBX_MAX_LOCUS || end > TBX_MAX_LOCUS)
+    {
+        fprintf(stderr, "Can't tabix index a line past locus %d: %.*s", TBX_MAX_LOCUS, (int)len, line);
+        return -1;
+    }
+
+    int last_ref = idx->last_ref, n_refs = idx->n_refs;
+    tbx_ref_t *r = tbxGetRef(idx, name, l_name);
+
+    if (idx->last_ref != last_ref && idx->n_refs == n_refs)
+    {
+        fprintf(stderr, "Can't tabix index lines of a contig that are not together: %.*s", (int)len, line);
+        return -1;
+    }
+
+    if (idx->last_ref == last_ref && beg < idx->last_beg)
+    {
+        fprintf(stderr, "Can't tabix index lines that are not sorted by start: %.*s", (int)len, line);
+        return -1;
+    }
+
+    idx->last_beg = beg;
+
+    tbxAdd(r, (uint32_t)(beg - 1), (uint32_t)end, u, v);
+
+    return 0;
+}
+
+static void tbxWrite32(BGZF *fp, int32_t x)
+{
+    bgzf_write(fp, &x, 4);
+}
+
+// Dump the index in .tbi layout.
+// Little-endian hosts only, as samtools
+//
+static int tbxSave(tbx_index_t *idx, const char *fn)
+{
+    BGZF *fp = bgzf_open(fn, "w");
+
+    if (!fp) return -1;
+
+    int i, l_nm = 0;
+
+    bgzf_write(fp, "TBI\1", 4);
+    tbxWrite32(fp, idx->n_refs);
+
+    // generic preset, 1-based starts, '#' meta lines
+    tbxWrite32(fp, 0);
+    tbxWrite32(fp, idx->col_seq);
+    tbxWrite32(fp, idx->col_beg);
+    tbxWrite32(fp, idx->col_end);
+    tbxWrite32(fp, '#');
+    tbxWrite32(fp, 0);
+
+    for (i = 0; i < idx->n_refs; ++i) l_nm += strlen(idx->refs[i].name) + 1;
+
+    tbxWrite32(fp, l_nm);
+
+    for (i = 0; i < idx->n_refs; ++i)
+    {
+        bgzf_write(fp, idx->refs[i].name, strlen(idx->refs[i].name) + 1);
+    }
+
+    for (i = 0; i < idx->n_refs; ++i)
+    {
+        tbx_ref_t *r = idx->refs + i;
+        khiter_t k;
+        int w;
+
+        tbxWrite32(fp, kh_size(r->bins));
+
+        for (k = kh_begin(r->bins); k != kh_end(r->bins); ++k)
+        {
+            if (!kh_exist(r->bins, k)) continue;
+
+            tbx_bin_t *bin = &kh_value(r->bins, k);
+            uint32_t bin_id = kh_key(r->bins, k);
+
+            bgzf_write(fp, &bin_id, 4);
+            tbxWrite32(fp, bin->n);
+            bgzf_write(fp, bin->list, bin->n * sizeof(tbx_chunk_t));
+        }
+
+        // Empty windows point at
+        // the previous record
+        //
+        for (w = 1; w < r->n_intv; ++w)
+        {
+            if (r->ioff[w] == 0) r->ioff[w] = r->ioff[w - 1];
+        }
+
+        tbxWrite32(fp, r->n_intv);
+        bgzf_write(fp, r->ioff, r->n_intv * sizeof(uint64_t));
+    }
+
+    return bgzf_close(fp);
+}
+
+static void tbxDestroy(tbx_index_t *idx)
+{
+    int i;
+
+    for (i = 0; i < idx->n_refs; ++i)
+    {
+        tbx_ref_t *r = idx->refs + i;
+        khiter_t k;
+
+        for (k = kh_begin(r->bins); k != kh_end(r->bins); ++k)
+        {
+            if (kh_exist(r->bins, k)) free(kh_value(r->bins, k).list);
+        }
+
+        kh_destroy(tbx_bin, r->bins);
+        free(r->ioff);
+        free(r->name);
+    }
+
+    kh_destroy(s, idx->ref_hash);
+    free(idx->refs);
+    free(idx);
+}
+
+// Open path for writing. With bgzip, lines are indexed on columns
+// col_seq/col_beg/col_end and the index goes to path.tbi on close
+//
+static roi_writer_t *wOpen(const char *path, bool bgzip, int col_seq, int col_beg, int col_end)
+{
+    roi_writer_t *w = (roi_writer_t*)calloc(1, sizeof(roi_writer_t));
+
+    if (bgzip)
+    {
+        w->bgzf = bgzf_open(path, "w");
+        w->tbi = tbxInit(col_seq, col_beg, col_end);
+    }
+    else
+    {
+        w->fp = fopen(path, "w");
+    }
+
+    if (!w->fp && !w->bgzf)
+    {
+        if (w->tbi) tbxDestroy(w->tbi);
+        free(w);
+        return NULL;
+    }
+
+    w->path = strdup(path);
+    w->cap = WRITER_FLUSH_SIZE * 2;
+    w->buf = (char*)malloc(w->cap);
+
+    return w;
+}
+
+static inline void wReserve(roi_writer_t *w, size_t n)
+{
+    if (w->len + n > w->cap)
+    {
+        while (w->len + n > w->cap) w->cap <<= 1;
+        w->buf = (char*)realloc(w->buf, w->cap);
+    }
+}
+
+static inline void wPutc(roi_writer_t *w, char c)
+{
+    wReserve(w, 1);
+    w->buf[w->len++] = c;
+}
+
+static inline void wPuts(roi_writer_t *w, const char *str)
+{
+    size_t n = strlen(str);
+
+    wReserve(w, n);
+    memcpy(w->buf + w->len, str, n);
+    w->len += n;
+}
+
+// Unsigned decimal, written
+// back to front
+//
+static inline void wPutu(roi_writer_t *w, uint64_t x)
+{
+    char tmp[20];
+    int n = 0;
+
+    do
+    {
+        tmp[n++] = '0' + x % 10;
+        x /= 10;
+
+    } while (x);
+
+    wReserve(w, n);
+
+    while (n) w->buf[w->len++] = tmp[--n];
+}
+
+// Hand everything assembled so far to the sink.
+// BGZF output is only ever flushed at line ends
+//
+static void wFlush(roi_writer_t *w)
+{
+    if (w->len == 0) return;
+
+    if (w->fp)
+    {
+        fwrite(w->buf, 1, w->len, w->fp);
+    }
+    else
+    {
+        bgzf_write(w->bgzf, w->buf, w->len);
+    }
+
+    w->len = 0;
+}
+
+// Terminate the current line. BGZF lines are written one by one
+// so their virtual offsets can go into the index; -1 if the line 
+// can't be indexed
+//
+static int wEndLine(roi_writer_t *w)
+{
+    int ret = 0;
+
+    wPutc(w, '\n');
+
+    if (w->fp)
+    {
+        if (w->len >= WRITER_FLUSH_SIZE) wFlush(w);
+        return 0;
+    }
+
+    uint64_t u = bgzf_tell(w->bgzf);
+
+    bgzf_write(w->bgzf, w->buf, w->len);
+
+    if (w->buf[0] != '#')
+    {
+        ret = tbxAddLine(w->tbi, w->buf, w->len, u, bgzf_tell(w->bgzf));
+    }
+
+    w->len = 0;
+
+    return ret;
+}
+
+// Write a whole line, e.g. one
+// copied from another output
+//
+static int wPutLine(roi_writer_t *w, const char *line)
+{
+    size_t n = strcspn(line, "\n");
+
+    wReserve(w, n);
+    memcpy(w->buf + w->len, line, n);
+    w->len += n;
+
+    return wEndLine(w);
+}
+
+// Push everything written so far to disk and return the file offset
+// it ends at. BGZF output is cut at a block boundary, so the file can
+// later be truncated there and appended to
+//
+static int64_t wSync(roi_writer_t *w)
+{
+    wFlush(w);
+
+    if (w->fp)
+    {
+        fflush(w->fp);
+        fsync(fileno(w->fp));
+
+        return (int64_t)ftello(w->fp);
+    }
+
+    bgzf_flush(w->bgzf);
+    fflush((FILE*)w->bgzf->fp);
+    fsync(fileno((FILE*)w->bgzf->fp));
+
+    return w->bgzf->block_address;
+}
+
+// Reopen an output cut short at offset (as returned by wSync) and 
+// continue writing after it. For BGZF the index of the lines kept
+// is rebuilt by reading them back
+//
+static roi_writer_t *wResume(const char *path, int64_t offset, bool bgzip, int col_seq, int col_beg, int col_end)
+{
+    if (truncate(path, offset) != 0) return NULL;
+
+    roi_writer_t *w = (roi_writer_t*)calloc(1, sizeof(roi_writer_t));
+
+    if (bgzip)
+    {
+        w->tbi = tbxInit(col_seq, col_beg, col_end);
+
+        BGZF *in = bgzf_open(path, "r");
+        kstring_t str = { 0, 0, NULL };
+
+        if (in)
+        {
+            uint64_t u = bgzf_tell(in);
+
+            while (bgzf_getline(in, '\n', &str) >= 0)
+            {
+                uint64_t v = bgzf_tell(in);
+
+                if (str.l && str.s[0] != '#') tbxAddLine(w->tbi, str.s, str.l, u, v);
+
+                u = v;
+            }
+
+            bgzf_close(in);
+        }
+
+        free(str.s);
+
+        // A fresh BGZF handle counts block addresses from 0,
+        // the blocks kept in the file come before it
+        //
+        int fd = open(path, O_WRONLY | O_APPEND);
+
+        if (fd >= 0)
+        {
+            w->bgzf = bgzf_dopen(fd, "w");
+
+            if (w->bgzf) w->bgzf->block_address = offset;
+        }
+    }
+    else
+    {
+        w->fp = fopen(path, "a");
+    }
+
+    if (!w->fp && !w->bgzf)
+    {
+        if (w->tbi) tbxDestroy(w->tbi);
+        free(w);
+        return NULL;
+    }
+
+    w->path = strdup(path);
+    w->cap = WRITER_FLUSH_SIZE * 2;
+    w->buf = (char*)malloc(w->cap);
+
+    return w;
+}
+
+static int wClose(roi_writer_t *w)
+{
+    int ret = 0;
+
+    wFlush(w);
+
+    if (w->fp)
+    {
+        ret = fclose(w->fp);
+    }
+    else
+    {
+        ret = bgzf_close(w->bgzf);
+
+        char *fn = (char*)malloc(strlen(w->path) + 5);
+
+        sprintf(fn, "%s.tbi", w->path);
+
+        if (tbxSave(w->tbi, fn) != 0)
+        {
+            fprintf(stderr, "Failed to write tabix index %s\n", fn);
+            ret = -1;
+        }
+
+        free(fn);
+        tbxDestroy(w->tbi);
+    }
+
+    free(w->path);
+    free(w->buf);
+    free(w);
+
+    return ret;
+}
+
+// Line reader over plain or bgzip-compressed
+// text, used when merging shard outputs
+//
+typedef struct
+{
+    FILE *fp;
+    BGZF *bgzf;
+    kstring_t str;
+
+} roi_reader_t;
+
+static roi_reader_t *rOpen(const char *path, bool *bgzip)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) return NULL;
+
+    roi_reader_t *r = (roi_reader_t*)calloc(1, sizeof(roi_reader_t));
+    int c1 = fgetc(fp), c2 = fgetc(fp);
+
+    *bgzip = (c1 == 0x1f && c2 == 0x8b);
+
+    if (*bgzip)
+    {
+        fclose(fp);
+        r->bgzf = bgzf_open(path, "r");
+    }
+    else
+    {
+        rewind(fp);
+        r->fp = fp;
+    }
+
+    return r;
+}
+
+// Next line including its '\n',
+// NULL at the end of the file
+//
+static char *rGetLine(roi_reader_t *r)
+{
+    if (r->fp)
+    {
+        ssize_t n = getline(&r->str.s, &r->str.m, r->fp);
+
+        return (n < 0) ? NULL : r->str.s;
+    }
+
+    if (bgzf_getline(r->bgzf, '\n', &r->str) < 0) return NULL;
+
+    if (r->str.l + 2 > r->str.m)
+    {
+        r->str.m = r->str.l + 2;
+        r->str.s = (char*)realloc(r->str.s, r->str.m);
+    }
+
+    r->str.s[r->str.l++] = '\n';
+    r->str.s[r->str.l] = '\0';
+
+    return r->str.s;
+}
+
+static void rClose(roi_reader_t *r)
+{
+    if (r->fp) fclose(r->fp);
+    if (r->bgzf) bgzf_close(r->bgzf);
+
+    free(r->str.s);
+    free(r);
+}
+
+#endif